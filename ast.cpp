@@ -1,4 +1,12 @@
 #include "ast.hpp"
 #include "sem.hpp"
+#include "simplify.hpp"
+#include "closure.hpp"
+#include "bounds.hpp"
+#include "escape.hpp"
 #include "compile.hpp"
+#include "gc.hpp"
+#include "rc.hpp"
+#include "hashcons.hpp"
+#include "jit.hpp"
 #include "print.hpp"
\ No newline at end of file
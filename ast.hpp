@@ -1,20 +1,28 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 
 #include "symbol.hpp"
 
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Verifier.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Utils.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
@@ -69,15 +77,38 @@ typedef enum
   type_ref,
   type_array,
   type_id,
+  type_tuple,
   type_undefined
 } main_type;
 
+// Outcome of matching a pattern against a statically known value
+typedef enum
+{
+  decide_fail,
+  decide_match,
+  decide_unknown
+} decide_enum;
+
+// Cells are aligned so that this many tags fit in the low bits of their
+// pointers
+static const int PointerTags = 8;
+
+// Dimension k of array a, as (a, k)
+typedef std::pair<std::string, int> dim_ref;
+
+class Expr;
+class NormalDef;
+
 class AST
 {
 public:
   virtual ~AST() {}
   virtual void printOn(std::ostream &out) const = 0;
   virtual void sem() {}
+  virtual void lift() {}
+  virtual void bounds() {}
+  virtual void escape() {}
+  virtual void simplify() {}
 
 protected:
   static std::string str_print_int;
@@ -115,7 +146,7 @@ protected:
   static LLVMContext TheContext;
   static IRBuilder<> Builder;
   static std::unique_ptr<Module> TheModule;
-  static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+  static TargetMachine *TheTargetMachine;
   // Useful LLVM types
   static llvm::Type *i1;
   static llvm::Type *i8;
@@ -123,6 +154,99 @@ protected:
   static llvm::Type *i64;
   static llvm::Type *flo;
   static llvm::StructType *voi;
+  // Storage of parameters and local bindings by (unique) name
+  static std::map<std::string, Value *> NamedValues;
+  // Function being compiled and the slots its self tail calls jump back with
+  static std::string TailId;
+  static BasicBlock *LoopBB;
+  static std::vector<Value *> LoopParams;
+  // Whether array accesses are checked, and the facts that prove them safe
+  static bool BoundsCheck;
+  static std::map<std::string, dim_ref> IndexRanges;
+  static std::vector<std::pair<dim_ref, dim_ref>> DimEquals;
+  bool in_range(const std::string &x, const dim_ref &d) const;
+  Value *createVariable(const std::string &id, llvm::Type *t) const;
+  Value *getVariable(const std::string &id) const;
+  // Allocation size of a type on the target
+  Value *sizeOf(llvm::Type *t) const;
+  // Whether a float is reachable from a value of the type, which makes a
+  // cell unequal to itself when it holds NaN
+  bool hasFloat(::Type *t, std::set<std::string> &seen) const;
+  // Branch to FalseBB unless two values of the type are equal, pushing the
+  // cells among them on the stack of llama_equal when there is one
+  void compareValues(Value *l, Value *r, ::Type *t, Value *stack, BasicBlock *FalseBB, bool physical = false) const;
+  // Structural equality of two tuples, stopping at the first mismatch
+  Value *tupleEq(Value *l, Value *r, ::Type *t, bool physical = false) const;
+  // Small cells of a known size come from the runtime's arena, the rest from malloc
+  Value *allocate(llvm::Type *t) const;
+  Value *allocateArray(Value *size, llvm::Type *elem, int dims) const;
+  void deallocate(Value *ptr, llvm::Type *t) const;
+  // With -fgc, every function keeps the values that may point to the heap in
+  // a frame of roots, and top level bindings are registered once
+  static bool GC;
+  static std::map<Function *, std::vector<AllocaInst *>> GCRoots;
+  static std::vector<GlobalVariable *> GCGlobals;
+  void pointerOffsets(llvm::Type *t, uint64_t base, std::vector<uint64_t> &offs) const;
+  Constant *layout(uint64_t size, int dims, const std::vector<uint64_t> &offs) const;
+  Constant *layoutOf(llvm::Type *t, int dims) const;
+  void addRoot(Value *var, llvm::Type *t) const;
+  Value *keep(Value *v) const;
+  // With -frc, values of data types count their references: a variable owns
+  // one, handed over at its last use and dropped where it dies, and a cell
+  // dropped right before a constructor of its size is rebuilt in place
+  static bool RC;
+  static std::set<std::string> LiveAfter;
+  static std::vector<std::pair<Value *, uint64_t>> ReuseTokens;
+  static std::map<std::string, ConstrEntry *> KnownShape;
+  // Types of the tuples the program builds, whose components are not counted
+  static std::vector<::Type *> TupleTypes;
+  bool isADT(::Type *t) const;
+  bool holdsADT(::Type *t) const;
+  bool owned(const std::string &id) const;
+  Value *compileLive(Expr *e, const std::set<std::string> &later) const;
+  void dup(Value *v) const;
+  void drop(Value *v) const;
+  void dropVars(const std::set<std::string> &vars, const std::set<std::string> &keep = {}) const;
+  void dropReuse(Value *v, ConstrEntry *shape) const;
+  Value *takeToken(uint64_t size) const;
+  void releaseTokens(size_t mark) const;
+  void releaseAllTokens() const;
+  uint64_t cellSize(ConstrEntry *e) const;
+  Value *untag(Value *v) const;
+  Value *allocateCell(ConstrEntry *e, Value *reuse) const;
+  // Refs, arrays and constructor values no pointer outlives are made in the
+  // frame; a parameter escapes the variables passed to it
+  static std::set<std::string> Escaping;
+  static std::multimap<std::string, std::string> FlowsTo;
+  static std::string EscapeFn;
+  // Constant bindings to constructors applied to variables and literals
+  static std::map<std::string, Expr *> KnownValues;
+  bool escapes(const std::string &id) const;
+  Value *allocateFrame(llvm::Type *t, const std::vector<int64_t> &header = {}) const;
+  // With -fhash-cons, the cells of data types that never change are shared
+  // between equal values
+  static bool HashCons;
+  static std::set<std::string> Interned;
+  bool immutable(::Type *t, std::set<std::string> &seen) const;
+  bool interned(::Type *t) const;
+  Value *internCell(ConstrEntry *e, const std::vector<Value *> &fields) const;
+  std::set<std::string> usesOf(const Expr *e) const;
+  std::vector<Value *> compileArgs(const std::vector<Expr *> &args) const;
+  // Records of constructors: the tag is the smallest integer that fits. For
+  // types with few constructors it is kept in the low bits of the pointers
+  // to them instead, so matching reads no memory and the record has no
+  // room for it
+  llvm::IntegerType *tagType(const std::string &id) const;
+  ConstantInt *tagOf(ConstrEntry *e) const;
+  bool tagged(const std::string &id) const;
+  // A type whose only constructor has a single int, char or bool field is
+  // represented by that field
+  bool unboxed(const std::string &id) const;
+  Value *tagPtr(Value *cell, ConstrEntry *e) const;
+  Value *loadTag(Value *v, const std::string &id) const;
+  Value *fieldPtr(ConstrEntry *e, Value *v, size_t i) const;
+  // Load from the descriptor in front of an array's elements
+  Value *loadHeader(Value *ptr64, int index, const std::string &name) const;
   // Useful LLVM helper functions
   ConstantInt *c1(bool b) const
   {
@@ -168,11 +292,26 @@ public:
   Program(std::vector<Stmt *> *s) : statements(s) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual void simplify() override;
+  void gc();
+  void rc();
+  void hash_cons();
   virtual void compile() const;
-  void llvm_compile_and_dump(bool optimize, llvm::raw_fd_ostream *imm_file, llvm::raw_fd_ostream *asm_file);
+  void llvm_compile_and_dump(int opt_level, std::string CPU, std::string Features, llvm::raw_fd_ostream *imm_file, llvm::raw_fd_ostream *asm_file, bool object_code);
+  int llvm_run(int opt_level, std::string CPU, std::string Features, std::string cache_dir);
 
 private:
   std::vector<Stmt *> *statements;
+  void llvm_compile(int opt_level, std::string CPU, std::string Features, bool jit);
+  void llvm_allocator();
+  void llvm_gc_frames();
+  void llvm_rc_runtime();
+  void llvm_hash_cons_runtime();
+  void llvm_optimize(int opt_level);
+  void llvm_emit(llvm::raw_pwrite_stream &out, bool object_code);
 };
 
 class Type : public AST
@@ -181,6 +320,8 @@ public:
   virtual main_type get_type() = 0;
   virtual ::Type *getChild1();
   virtual ::Type *getChild2();
+  // Component i of a tuple, which has getDim of them
+  virtual ::Type *getChild(int i);
   virtual int getDim();
   virtual std::string get_id();
   virtual bool equals(::Type *other);
@@ -295,6 +436,22 @@ private:
   std::string id;
 };
 
+class Type_Tuple : public ::Type
+{
+public:
+  Type_Tuple(std::vector<::Type *> *v) : type_vec(v) {}
+  virtual void printOn(std::ostream &out) const override;
+  virtual main_type get_type() override;
+  virtual ::Type *getChild(int i) override;
+  virtual int getDim() override;
+  virtual bool equals(::Type *other) override;
+  virtual void sem() override;
+  virtual llvm::Type *compile() const override;
+
+private:
+  std::vector<::Type *> *type_vec;
+};
+
 class Type_Undefined : public ::Type
 {
 public:
@@ -303,6 +460,7 @@ public:
   virtual main_type get_type() override;
   virtual ::Type *getChild1() override;
   virtual ::Type *getChild2() override;
+  virtual ::Type *getChild(int i) override;
   virtual int getDim() override;
   virtual std::string get_id() override;
   virtual bool equals(::Type *other) override;
@@ -316,6 +474,23 @@ class Expr : public AST
 {
 public:
   virtual void type_check(::Type *t);
+  virtual void mark_tail() {}
+  virtual bool get_int(int &n) const { return false; }
+  virtual bool get_var(std::string &x) const { return false; }
+  virtual bool get_dim(dim_ref &d) const { return false; }
+  virtual bool get_last_index(dim_ref &d) const { return false; }
+  virtual void dim_facts() const {}
+  // Variables the expression reads, with those of the functions it calls
+  virtual void uses(std::set<std::string> &vars) const {}
+  // Escape analysis of a use that only reads through the value, and of one
+  // that binds it to a variable or parameter
+  virtual void borrow() { escape(); }
+  virtual void flow(const std::string &to) { escape(); }
+  // The expression with the matches on known constructors resolved, and
+  // the constructor it is known to build
+  virtual Expr *simplified() { return this; }
+  virtual ConstrEntry *get_constr(std::vector<Expr *> &args) const { return nullptr; }
+  virtual bool get_tuple(std::vector<Expr *> &elems) const { return false; }
   ::Type *typ;
   virtual Value *compile() const = 0;
 };
@@ -326,6 +501,7 @@ public:
   Int_Expr(int n) : num(n) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual bool get_int(int &n) const override;
   virtual Value *compile() const override;
 
 private:
@@ -479,6 +655,11 @@ public:
   UnOp(unop_enum o, Expr *e) : op(o), expr(e) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -492,6 +673,14 @@ public:
   BinOp(Expr *e1, binop_enum o, Expr *e2) : left(e1), op(o), right(e2) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual bool get_last_index(dim_ref &d) const override;
+  virtual void dim_facts() const override;
+  virtual void mark_tail() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -506,35 +695,58 @@ public:
   id_Expr(std::string s) : id(s) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual bool get_var(std::string &x) const override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual void escape() override;
+  virtual void borrow() override {}
+  virtual void flow(const std::string &to) override;
+  virtual ConstrEntry *get_constr(std::vector<Expr *> &args) const override;
   virtual Value *compile() const override;
 
 private:
+  Value *closure(Function *func) const;
   std::string id;
 };
 
 class Id_Expr : public Expr
 {
 public:
-  Id_Expr(std::string s) : Id(s) {}
+  Id_Expr(std::string s) : Id(s), entry(nullptr) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual ConstrEntry *get_constr(std::vector<Expr *> &args) const override;
   virtual Value *compile() const override;
 
 private:
   std::string Id;
+  ConstrEntry *entry;
 };
 
 class call : public Expr
 {
 public:
-  call(std::string s, std::vector<Expr *> *v) : id(s), expr_vec(v) {}
+  call(std::string s, std::vector<Expr *> *v) : id(s), expr_vec(v), tail(false), temp(false) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void mark_tail() override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual void borrow() override;
+  virtual void flow(const std::string &to) override;
+  virtual ConstrEntry *get_constr(std::vector<Expr *> &args) const override;
   virtual Value *compile() const override;
 
 private:
   std::string id;
   std::vector<Expr *> *expr_vec;
+  bool tail;
+  // Variable the constructed value is bound to, or whether it is only matched
+  std::string owner;
+  bool temp;
 };
 
 class Array : public Expr
@@ -543,11 +755,38 @@ public:
   Array(std::string s, std::vector<Expr *> *v) : id(s), expr_vec(v) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual void borrow() override;
   virtual Value *compile() const override;
 
 private:
   std::string id;
   std::vector<Expr *> *expr_vec;
+  // Indices proven in range, which need no check
+  std::vector<bool> safe;
+};
+
+// A tuple is a first-class aggregate, passed and returned in registers
+class Tuple : public Expr
+{
+public:
+  Tuple(std::vector<Expr *> *v) : expr_vec(v) {}
+  virtual void printOn(std::ostream &out) const override;
+  virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual bool get_tuple(std::vector<Expr *> &elems) const override;
+  virtual Value *compile() const override;
+
+private:
+  std::vector<Expr *> *expr_vec;
 };
 
 class Dim : public Expr
@@ -556,6 +795,8 @@ public:
   Dim(std::string s, int i = 1) : id(s), ind(i) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual bool get_dim(dim_ref &d) const override;
   virtual Value *compile() const override;
 
 private:
@@ -566,13 +807,17 @@ private:
 class New : public Expr
 {
 public:
-  New(::Type *t) : ty(t) {}
+  New(::Type *t) : ty(t), temp(false) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void borrow() override;
+  virtual void flow(const std::string &to) override;
   virtual Value *compile() const override;
 
 private:
   ::Type *ty;
+  std::string owner;
+  bool temp;
 };
 
 class If : public Expr
@@ -581,6 +826,12 @@ public:
   If(Expr *e1, Expr *e2, Expr *e3) : expr1(e1), expr2(e2), expr3(e3) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void mark_tail() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -593,6 +844,11 @@ public:
   While(Expr *e1, Expr *e2) : cond(e1), stmt(e2) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -606,6 +862,11 @@ public:
       : id(s), start(e1), end(e2), stmt(e3), down(b) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -617,7 +878,23 @@ private:
 class Pattern : public AST
 {
 public:
-  virtual Value *compile(Value *v) const = 0;
+  // Test v, continuing on success and branching to FailBB otherwise
+  virtual void test(Value *v, BasicBlock *FailBB) const = 0;
+  // Test the fields of v once its tag is known to match
+  virtual void test_fields(Value *v, BasicBlock *FailBB) const {}
+  // Switch case of a literal or constructor pattern
+  virtual ConstantInt *get_case() const { return nullptr; }
+  virtual bool is_wildcard() const { return false; }
+  // Head constructor, its sub-patterns and all constructors of its type
+  // (empty when there are infinitely many), for the usefulness check
+  virtual std::string get_head() const { return ""; }
+  virtual std::vector<Pattern *> get_args() const { return {}; }
+  virtual std::vector<std::pair<std::string, int>> get_signature() const { return {}; }
+  // Variables bound by the pattern
+  virtual void binds(std::set<std::string> &vars) const {}
+  // Match against an expression whose constructors are known, collecting
+  // the bindings of the variables
+  virtual decide_enum decide(Expr *e, std::vector<NormalDef *> &defs) const { return decide_unknown; }
   ::Type *typ;
 };
 
@@ -627,7 +904,9 @@ public:
   Pattern_Int_Expr(int n) : num(n) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual std::string get_head() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual ConstantInt *get_case() const override;
 
 private:
   int num;
@@ -639,7 +918,8 @@ public:
   Pattern_Float_Expr(float n) : num(n) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual std::string get_head() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
 
 private:
   float num;
@@ -689,7 +969,9 @@ public:
   }
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual std::string get_head() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual ConstantInt *get_case() const override;
 
 private:
   char ch;
@@ -701,7 +983,10 @@ public:
   Pattern_Bool_Expr(bool b) : boolean(b) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual std::string get_head() const override;
+  virtual std::vector<std::pair<std::string, int>> get_signature() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual ConstantInt *get_case() const override;
 
 private:
   bool boolean;
@@ -713,7 +998,11 @@ public:
   Pattern_id(std::string s) : id(s) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual decide_enum decide(Expr *e, std::vector<NormalDef *> &defs) const override;
+  virtual void lift() override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual bool is_wildcard() const override { return true; }
+  virtual void binds(std::set<std::string> &vars) const override;
 
 private:
   std::string id;
@@ -722,27 +1011,60 @@ private:
 class Pattern_Id : public Pattern
 {
 public:
-  Pattern_Id(std::string s) : Id(s) {}
+  Pattern_Id(std::string s) : Id(s), entry(nullptr) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual decide_enum decide(Expr *e, std::vector<NormalDef *> &defs) const override;
+  virtual std::string get_head() const override;
+  virtual std::vector<std::pair<std::string, int>> get_signature() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual ConstantInt *get_case() const override;
 
 private:
   std::string Id;
+  ConstrEntry *entry;
 };
 
 class Pattern_Call : public Pattern
 {
 public:
   Pattern_Call(std::string s, std::vector<Pattern *> *v)
-      : Id(s), pattern_vec(v) {}
+      : Id(s), pattern_vec(v), entry(nullptr) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
-  virtual Value *compile(Value *v) const override;
+  virtual decide_enum decide(Expr *e, std::vector<NormalDef *> &defs) const override;
+  virtual void lift() override;
+  virtual std::string get_head() const override;
+  virtual std::vector<Pattern *> get_args() const override;
+  virtual std::vector<std::pair<std::string, int>> get_signature() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual void test_fields(Value *v, BasicBlock *FailBB) const override;
+  virtual ConstantInt *get_case() const override;
+  virtual void binds(std::set<std::string> &vars) const override;
+  ConstrEntry *shape() const { return entry; }
 
 private:
   std::string Id;
   std::vector<Pattern *> *pattern_vec;
+  ConstrEntry *entry;
+};
+
+class Pattern_Tuple : public Pattern
+{
+public:
+  Pattern_Tuple(std::vector<Pattern *> *v) : pattern_vec(v) {}
+  virtual void printOn(std::ostream &out) const override;
+  virtual void sem() override;
+  virtual decide_enum decide(Expr *e, std::vector<NormalDef *> &defs) const override;
+  virtual void lift() override;
+  virtual std::string get_head() const override;
+  virtual std::vector<Pattern *> get_args() const override;
+  virtual std::vector<std::pair<std::string, int>> get_signature() const override;
+  virtual void test(Value *v, BasicBlock *FailBB) const override;
+  virtual void binds(std::set<std::string> &vars) const override;
+
+private:
+  std::vector<Pattern *> *pattern_vec;
 };
 
 class Clause : public AST
@@ -751,6 +1073,11 @@ public:
   Clause(Pattern *p, Expr *e) : pat(p), expr(e) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual void simplify() override;
+  void uses(std::set<std::string> &vars) const;
   Pattern *pat;
   Expr *expr;
 };
@@ -758,14 +1085,23 @@ public:
 class Match : public Expr
 {
 public:
-  Match(Expr *e, std::vector<Clause *> *v) : expr(e), clause_vec(v) {}
+  Match(Expr *e, std::vector<Clause *> *v) : expr(e), clause_vec(v), exhaustive(false) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void mark_tail() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
+  void enter_clause(size_t i, Value *v, const std::set<std::string> &all) const;
   Expr *expr;
   std::vector<Clause *> *clause_vec;
+  // Whether the clauses cover every value
+  bool exhaustive;
 };
 
 class Par : public AST
@@ -784,6 +1120,8 @@ public:
   virtual void sem2() {}
   virtual void compile() const = 0;
   virtual void compile2() const {}
+  virtual void uses(std::set<std::string> &vars) const {}
+  virtual void binds(std::set<std::string> &vars) const {}
 };
 
 class NormalDef : public Def
@@ -792,10 +1130,16 @@ public:
   NormalDef(std::string s, std::vector<Par *> *v, ::Type *t, Expr *e)
       : id(s), par_vec(v), typ(t), expr(e) {}
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual void simplify() override;
   virtual void sem2() override;
   virtual void printOn(std::ostream &out) const override;
   virtual void compile() const override;
   virtual void compile2() const override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual void binds(std::set<std::string> &vars) const override;
 
 private:
   std::string id;
@@ -811,7 +1155,13 @@ public:
       : id(s), expr_vec(e), typ(t) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual void simplify() override;
   virtual void compile() const override;
+  virtual void uses(std::set<std::string> &vars) const override;
+  virtual void binds(std::set<std::string> &vars) const override;
 
 private:
   std::string id;
@@ -825,7 +1175,13 @@ public:
   LetDef(bool b, std::vector<Def *> *v) : rec(b), def_vec(v) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual void simplify() override;
   virtual void compile() const override;
+  void uses(std::set<std::string> &vars) const;
+  void binds(std::set<std::string> &vars) const;
 
 private:
   bool rec;
@@ -838,6 +1194,12 @@ public:
   LetIn(LetDef *d, Expr *e) : letdef(d), expr(e) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
+  virtual void lift() override;
+  virtual void bounds() override;
+  virtual void escape() override;
+  virtual Expr *simplified() override;
+  virtual void mark_tail() override;
+  virtual void uses(std::set<std::string> &vars) const override;
   virtual Value *compile() const override;
 
 private:
@@ -848,11 +1210,12 @@ private:
 class Constr : public AST
 {
 public:
-  Constr(std::string s, std::vector<::Type *> *v) : Id(s), type_vec(v) {}
+  Constr(std::string s, std::vector<::Type *> *v) : Id(s), entry(nullptr), type_vec(v) {}
   virtual void printOn(std::ostream &out) const override;
   virtual void sem() override;
   virtual void compile() const;
   std::string id, Id;
+  ConstrEntry *entry;
 
 private:
   std::vector<::Type *> *type_vec;
@@ -0,0 +1,205 @@
+#include "ast.hpp"
+
+// Bounds check elimination: an index is in range when it is the variable of
+// a for loop running from 0 to dim k a - c, c >= 1 (or back), possibly over
+// another dimension known equal to it through the condition of an enclosing if.
+
+bool AST::BoundsCheck = false;
+std::map<std::string, dim_ref> AST::IndexRanges;
+std::vector<std::pair<dim_ref, dim_ref>> AST::DimEquals;
+
+bool AST::in_range(const std::string &x, const dim_ref &d) const
+{
+  auto it = IndexRanges.find(x);
+  if (it == IndexRanges.end())
+  {
+    return false;
+  }
+  // Search the dimensions equal to the loop's, transitively
+  std::vector<dim_ref> seen = {it->second};
+  for (size_t i = 0; i < seen.size(); i++)
+  {
+    if (seen[i] == d)
+    {
+      return true;
+    }
+    for (auto &eq : DimEquals)
+    {
+      if (eq.first == seen[i] && std::find(seen.begin(), seen.end(), eq.second) == seen.end())
+      {
+        seen.push_back(eq.second);
+      }
+      if (eq.second == seen[i] && std::find(seen.begin(), seen.end(), eq.first) == seen.end())
+      {
+        seen.push_back(eq.first);
+      }
+    }
+  }
+  return false;
+}
+
+void Program::bounds()
+{
+  BoundsCheck = true;
+  for (Stmt *stmt : *statements)
+  {
+    stmt->bounds();
+  }
+}
+
+void LetDef::bounds()
+{
+  for (Def *def : *def_vec)
+  {
+    def->bounds();
+  }
+}
+
+void NormalDef::bounds()
+{
+  expr->bounds();
+}
+
+void MutableDef::bounds()
+{
+  if (expr_vec != nullptr)
+  {
+    for (Expr *e : *expr_vec)
+    {
+      e->bounds();
+    }
+  }
+}
+
+void LetIn::bounds()
+{
+  letdef->bounds();
+  expr->bounds();
+}
+
+void UnOp::bounds()
+{
+  expr->bounds();
+}
+
+void BinOp::bounds()
+{
+  left->bounds();
+  right->bounds();
+}
+
+void call::bounds()
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->bounds();
+  }
+}
+
+void Array::bounds()
+{
+  safe.clear();
+  for (size_t i = 0; i < expr_vec->size(); i++)
+  {
+    Expr *e = (*expr_vec)[i];
+    e->bounds();
+    std::string x;
+    safe.push_back(e->get_var(x) && in_range(x, dim_ref(id, i + 1)));
+  }
+}
+
+void Tuple::bounds()
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->bounds();
+  }
+}
+
+void If::bounds()
+{
+  expr1->bounds();
+  size_t facts = DimEquals.size();
+  expr1->dim_facts();
+  expr2->bounds();
+  DimEquals.resize(facts);
+  if (expr3 != nullptr)
+  {
+    expr3->bounds();
+  }
+}
+
+void While::bounds()
+{
+  cond->bounds();
+  stmt->bounds();
+}
+
+void For::bounds()
+{
+  start->bounds();
+  end->bounds();
+  int n;
+  dim_ref d;
+  if (down ? start->get_last_index(d) && end->get_int(n) && n >= 0
+           : start->get_int(n) && n >= 0 && end->get_last_index(d))
+  {
+    IndexRanges[id] = d;
+  }
+  stmt->bounds();
+  IndexRanges.erase(id);
+}
+
+void Match::bounds()
+{
+  expr->bounds();
+  for (Clause *cl : *clause_vec)
+  {
+    cl->bounds();
+  }
+}
+
+void Clause::bounds()
+{
+  expr->bounds();
+}
+
+// Recognizing the expressions the facts are made of
+
+bool Int_Expr::get_int(int &n) const
+{
+  n = num;
+  return true;
+}
+
+bool id_Expr::get_var(std::string &x) const
+{
+  x = id;
+  return true;
+}
+
+bool Dim::get_dim(dim_ref &d) const
+{
+  d = dim_ref(id, ind);
+  return true;
+}
+
+bool BinOp::get_last_index(dim_ref &d) const
+{
+  int n;
+  return op == binop_minus && left->get_dim(d) && right->get_int(n) && n >= 1;
+}
+
+void BinOp::dim_facts() const
+{
+  dim_ref d1, d2;
+  if (op == binop_and)
+  {
+    left->dim_facts();
+    right->dim_facts();
+  }
+  else if ((op == binop_struct_eq || op == binop_phys_eq) && left->get_dim(d1) && right->get_dim(d2))
+  {
+    DimEquals.push_back({d1, d2});
+  }
+}
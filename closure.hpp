@@ -0,0 +1,210 @@
+#include "ast.hpp"
+
+// Lambda lifting: every function receives the locals of enclosing
+// functions it needs as extra leading arguments, computed over the
+// functions it calls, so nested functions no longer share global state.
+
+extern FunctionTable ft;
+
+void Program::lift()
+{
+  for (Stmt *stmt : *statements)
+  {
+    stmt->lift();
+  }
+  ft.close();
+}
+
+void LetDef::lift()
+{
+  int prev = ft.group;
+  ft.group = rec ? ++ft.groups : 0;
+  for (Def *def : *def_vec)
+  {
+    def->lift();
+  }
+  ft.group = prev;
+}
+
+void NormalDef::lift()
+{
+  if (par_vec->size() == 0) // Constant
+  {
+    expr->lift();
+    ft.bind(id, typ);
+    return;
+  }
+  ft.openFunction(id);
+  for (Par *par : *par_vec)
+  {
+    ft.bind(par->id, par->typ);
+    ft.lookup(id)->params.push_back(par->id);
+  }
+  expr->lift();
+  expr->mark_tail();
+  ft.closeFunction();
+}
+
+void MutableDef::lift()
+{
+  if (expr_vec == nullptr)
+  {
+    ft.bind(id, new Type_Ref(typ));
+    return;
+  }
+  for (Expr *e : *expr_vec)
+  {
+    e->lift();
+  }
+  ft.bind(id, new Type_Array(expr_vec->size(), typ));
+}
+
+void LetIn::lift()
+{
+  letdef->lift();
+  expr->lift();
+}
+
+void UnOp::lift()
+{
+  expr->lift();
+}
+
+void BinOp::lift()
+{
+  left->lift();
+  right->lift();
+}
+
+void id_Expr::lift()
+{
+  ft.use(id);
+}
+
+void call::lift()
+{
+  ft.use(id);
+  for (Expr *e : *expr_vec)
+  {
+    e->lift();
+  }
+}
+
+void Array::lift()
+{
+  ft.use(id);
+  for (Expr *e : *expr_vec)
+  {
+    e->lift();
+  }
+}
+
+void Tuple::lift()
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->lift();
+  }
+}
+
+void Dim::lift()
+{
+  ft.use(id);
+}
+
+void If::lift()
+{
+  expr1->lift();
+  expr2->lift();
+  if (expr3 != nullptr)
+  {
+    expr3->lift();
+  }
+}
+
+void While::lift()
+{
+  cond->lift();
+  stmt->lift();
+}
+
+void For::lift()
+{
+  start->lift();
+  end->lift();
+  ft.bind(id, new Type_Int());
+  stmt->lift();
+}
+
+void Match::lift()
+{
+  expr->lift();
+  for (Clause *cl : *clause_vec)
+  {
+    cl->lift();
+  }
+}
+
+void Clause::lift()
+{
+  pat->lift();
+  expr->lift();
+}
+
+void Pattern_id::lift()
+{
+  ft.bind(id, typ);
+}
+
+void Pattern_Call::lift()
+{
+  for (Pattern *pat : *pattern_vec)
+  {
+    pat->lift();
+  }
+}
+
+void Pattern_Tuple::lift()
+{
+  for (Pattern *pat : *pattern_vec)
+  {
+    pat->lift();
+  }
+}
+
+// Calls whose result is the result of the enclosing function
+
+void LetIn::mark_tail()
+{
+  expr->mark_tail();
+}
+
+void BinOp::mark_tail()
+{
+  if (op == binop_semicolon)
+  {
+    right->mark_tail();
+  }
+}
+
+void call::mark_tail()
+{
+  tail = true;
+}
+
+void If::mark_tail()
+{
+  expr2->mark_tail();
+  if (expr3 != nullptr)
+  {
+    expr3->mark_tail();
+  }
+}
+
+void Match::mark_tail()
+{
+  for (Clause *cl : *clause_vec)
+  {
+    cl->expr->mark_tail();
+  }
+}
@@ -5,28 +5,198 @@ using namespace llvm;
 LLVMContext AST::TheContext;
 IRBuilder<> AST::Builder(TheContext);
 std::unique_ptr<Module> AST::TheModule;
-std::unique_ptr<legacy::FunctionPassManager> AST::TheFPM;
 llvm::Type *AST::i1;
 llvm::Type *AST::i8;
 llvm::Type *AST::i32;
 llvm::Type *AST::i64;
 llvm::Type *AST::flo;
 StructType *AST::voi;
+TargetMachine *AST::TheTargetMachine;
+std::map<std::string, Value *> AST::NamedValues;
+std::string AST::TailId;
+BasicBlock *AST::LoopBB;
+std::vector<Value *> AST::LoopParams;
 
-void Program::llvm_compile_and_dump(bool optimize, raw_fd_ostream *imm_file, raw_fd_ostream *asm_file)
+Value *AST::createVariable(const std::string &id, llvm::Type *t) const
 {
-  // Initialize the module and the optimization passes
-  TheModule = std::make_unique<Module>("Llama program", TheContext);
-  TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
-  if (optimize)
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  Value *var;
+  if (TheFunction == TheModule->getFunction("main") && ft.shared(id))
+  {
+    // Top level bindings that functions refer to live in globals
+    var = new GlobalVariable(*TheModule, t, false, GlobalValue::PrivateLinkage, Constant::getNullValue(t), id);
+  }
+  else
+  {
+    // Stack slot in the entry block, promoted to a register by mem2reg
+    BasicBlock &EntryBB = TheFunction->getEntryBlock();
+    IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+    var = TmpB.CreateAlloca(t, nullptr, id);
+  }
+  addRoot(var, t);
+  NamedValues[id] = var;
+  return var;
+}
+
+Value *AST::getVariable(const std::string &id) const
+{
+  auto it = NamedValues.find(id);
+  return it == NamedValues.end() ? nullptr : it->second;
+}
+
+Value *AST::sizeOf(llvm::Type *t) const
+{
+  return c64(TheModule->getDataLayout().getTypeAllocSize(t));
+}
+
+// Largest cell served by the arena, and its size classes
+static const int MaxSmall = 256;
+static const int Granule = 8;
+
+Value *AST::allocate(llvm::Type *t) const
+{
+  int size = TheModule->getDataLayout().getTypeAllocSize(t);
+  if (GC)
+  {
+    return Builder.CreateCall(TheModule->getFunction("llama_gc_alloc"), {c64(size), layoutOf(t, 0)});
+  }
+  if (size > MaxSmall)
+  {
+    return Builder.CreateCall(TheModule->getFunction("malloc"), {c64(size)});
+  }
+  // A cell of no size still needs room for the free list's link
+  int rounded = std::max(Granule, (size + Granule - 1) / Granule * Granule);
+  return Builder.CreateCall(TheModule->getFunction("llama_alloc"), {c64(rounded)});
+}
+
+Value *AST::allocateArray(Value *size, llvm::Type *elem, int dims) const
+{
+  if (GC)
+  {
+    return Builder.CreateCall(TheModule->getFunction("llama_gc_alloc"), {size, layoutOf(elem, dims)});
+  }
+  return Builder.CreateCall(TheModule->getFunction("malloc"), {size});
+}
+
+void AST::deallocate(Value *ptr, llvm::Type *t) const
+{
+  // The collector frees what is unreachable on its own
+  if (GC)
+  {
+    return;
+  }
+  ptr = Builder.CreateBitCast(ptr, PointerType::get(i64, 0));
+  int size = TheModule->getDataLayout().getTypeAllocSize(t);
+  int rounded = std::max(Granule, (size + Granule - 1) / Granule * Granule);
+  Builder.CreateCall(TheModule->getFunction("llama_free"), {ptr, c64(rounded)});
+}
+
+void Program::llvm_allocator()
+{
+  // The runtime's state, shared with lib/alloc.c
+  PointerType *i8p = PointerType::get(i8, 0);
+  ArrayType *lists_type = ArrayType::get(i8p, MaxSmall / Granule + 1);
+  GlobalVariable *heap_ptr = new GlobalVariable(*TheModule, i8p, false, GlobalValue::ExternalLinkage, nullptr, "llama_heap_ptr");
+  GlobalVariable *heap_end = new GlobalVariable(*TheModule, i8p, false, GlobalValue::ExternalLinkage, nullptr, "llama_heap_end");
+  GlobalVariable *free_list = new GlobalVariable(*TheModule, lists_type, false, GlobalValue::ExternalLinkage, nullptr, "llama_free_list");
+  // Fast path, inlined where the size is a constant: pop the size class's
+  // free list, else bump the region pointer, else call the runtime
+  FunctionType *alloc_type = FunctionType::get(PointerType::get(i64, 0), {i64}, false);
+  Function *func = Function::Create(alloc_type, Function::InternalLinkage, "llama_alloc", TheModule.get());
+  func->addFnAttr(Attribute::AlwaysInline);
+  func->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+  Value *size = func->arg_begin();
+  BasicBlock *EntryBB = BasicBlock::Create(TheContext, "entry", func);
+  BasicBlock *PopBB = BasicBlock::Create(TheContext, "pop", func);
+  BasicBlock *BumpBB = BasicBlock::Create(TheContext, "bump", func);
+  BasicBlock *FitsBB = BasicBlock::Create(TheContext, "fits", func);
+  BasicBlock *SlowBB = BasicBlock::Create(TheContext, "slow", func);
+  MDBuilder MDB(TheContext);
+  Builder.SetInsertPoint(EntryBB);
+  Value *head_ptr = Builder.CreateInBoundsGEP(free_list, {c64(0), Builder.CreateLShr(size, c64(3))});
+  Value *head = Builder.CreateLoad(head_ptr, "head");
+  Builder.CreateCondBr(Builder.CreateIsNull(head), BumpBB, PopBB);
+  Builder.SetInsertPoint(PopBB);
+  Value *next = Builder.CreateLoad(Builder.CreateBitCast(head, PointerType::get(i8p, 0)), "next");
+  Builder.CreateStore(next, head_ptr);
+  Builder.CreateRet(Builder.CreateBitCast(head, PointerType::get(i64, 0)));
+  Builder.SetInsertPoint(BumpBB);
+  Value *ptr = Builder.CreateLoad(heap_ptr, "ptr");
+  Value *new_ptr = Builder.CreateGEP(ptr, size, "new_ptr");
+  Value *fits = Builder.CreateICmpULE(new_ptr, Builder.CreateLoad(heap_end, "end"));
+  Builder.CreateCondBr(fits, FitsBB, SlowBB, MDB.createBranchWeights(2000, 1));
+  Builder.SetInsertPoint(FitsBB);
+  Builder.CreateStore(new_ptr, heap_ptr);
+  Builder.CreateRet(Builder.CreateBitCast(ptr, PointerType::get(i64, 0)));
+  Builder.SetInsertPoint(SlowBB);
+  Builder.CreateRet(Builder.CreateCall(TheModule->getFunction("llama_alloc_slow"), {size}));
+  if (GC)
   {
-    TheFPM->add(createPromoteMemoryToRegisterPass());
-    TheFPM->add(createInstructionCombiningPass());
-    TheFPM->add(createReassociatePass());
-    TheFPM->add(createGVNPass());
-    TheFPM->add(createCFGSimplificationPass());
+    FunctionType *gc_alloc_type = FunctionType::get(PointerType::get(i64, 0), {i64, PointerType::get(i64, 0)}, false);
+    Function::Create(gc_alloc_type, Function::ExternalLinkage, "llama_gc_alloc", TheModule.get())->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+    FunctionType *add_root_type = FunctionType::get(voi, {i8p, PointerType::get(i64, 0)}, false);
+    Function::Create(add_root_type, Function::ExternalLinkage, "llama_gc_add_root", TheModule.get());
+    new GlobalVariable(*TheModule, i8p, false, GlobalValue::ExternalLinkage, nullptr, "llama_gc_roots");
+  }
+}
+
+Value *AST::loadHeader(Value *ptr64, int index, const std::string &name) const
+{
+  // Dimensions and strides never change once the array is made. A heap
+  // array's are written right after the call making it, and its pointer
+  // comes from that call, so no load of them can be moved above the
+  // writes; a frame array's are written with the frame
+  LoadInst *load = Builder.CreateLoad(Builder.CreateInBoundsGEP(ptr64, {c64(index)}), name);
+  load->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(TheContext, {}));
+  return load;
+}
+
+void Program::llvm_compile(int opt_level, std::string CPU, std::string Features, bool jit)
+{
+  // Set up the target
+  std::string TargetTriple = sys::getDefaultTargetTriple();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!TheTarget)
+  {
+    errs() << "Failed to get target: " << Error;
+    exit(1);
+  }
+  if (CPU == "native")
+  {
+    CPU = sys::getHostCPUName().str();
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+    {
+      // Explicit -mattr features come last and override the host's
+      std::string HostList = "";
+      for (auto &feature : HostFeatures)
+      {
+        HostList += (feature.second ? "+" : "-") + feature.first().str() + ",";
+      }
+      Features = HostList + Features;
+      if (!Features.empty() && Features.back() == ',')
+      {
+        Features.pop_back();
+      }
+    }
   }
-  TheFPM->doInitialization();
+  TargetOptions opt;
+  // Calls in tail position between fastcc functions never grow the stack
+  opt.GuaranteedTailCallOpt = true;
+  // Code loaded by the JIT may land anywhere in the address space
+  Optional<Reloc::Model> RM = jit ? Reloc::PIC_ : Optional<Reloc::Model>();
+  TheTargetMachine = TheTarget->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+  CodeGenOpt::Level cg_levels[] = {CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default, CodeGenOpt::Aggressive};
+  TheTargetMachine->setOptLevel(cg_levels[opt_level]);
+  // Initialize the module with the target's layout, used for every size computation
+  TheModule = std::make_unique<Module>("Llama program", TheContext);
+  TheModule->setTargetTriple(TargetTriple);
+  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
   // Define types
   i1 = IntegerType::get(TheContext, 1);
   i8 = IntegerType::get(TheContext, 8);
@@ -37,11 +207,16 @@ void Program::llvm_compile_and_dump(bool optimize, raw_fd_ostream *imm_file, raw
   // Declare malloc
   FunctionType *malloc_type = FunctionType::get(PointerType::get(i64, 0), {i64}, false);
   Function::Create(malloc_type, Function::ExternalLinkage, "malloc", TheModule.get());
-  FunctionType *free_type = FunctionType::get(voi, {PointerType::get(i64, 0)}, false);
-  Function::Create(free_type, Function::ExternalLinkage, "free", TheModule.get());
   // Declare exit
   FunctionType *exit_type = FunctionType::get(voi, {i64}, false);
   Function::Create(exit_type, Function::ExternalLinkage, "exit", TheModule.get());
+  // Declare the driver of structural equality
+  PointerType *i64p = PointerType::get(i64, 0);
+  PointerType *i8p = PointerType::get(i8, 0);
+  FunctionType *equal_type = FunctionType::get(i1, {i64p, i64p, i8p}, false);
+  Function::Create(equal_type, Function::ExternalLinkage, "llama_equal", TheModule.get())->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
+  FunctionType *eq_push_type = FunctionType::get(voi, {i8p, i64p, i64p, i8p}, false);
+  Function::Create(eq_push_type, Function::ExternalLinkage, "llama_eq_push", TheModule.get());
   // Declare pow
   FunctionType *pow_type = FunctionType::get(flo, {flo, flo}, false);
   Function::Create(pow_type, Function::ExternalLinkage, "powf", TheModule.get());
@@ -113,6 +288,41 @@ void Program::llvm_compile_and_dump(bool optimize, raw_fd_ostream *imm_file, raw
   Function::Create(strcpy_type, Function::ExternalLinkage, str_strcpy, TheModule.get());
   FunctionType *strcat_type = FunctionType::get(voi, {PointerType::get(i8, 0), PointerType::get(i8, 0)}, false);
   Function::Create(strcat_type, Function::ExternalLinkage, str_strcat, TheModule.get());
+  // Declare the failure of a bounds check
+  FunctionType *bounds_error_type = FunctionType::get(voi, {}, false);
+  Function *bounds_error = Function::Create(bounds_error_type, Function::ExternalLinkage, "array_bounds_error", TheModule.get());
+  bounds_error->setDoesNotReturn();
+  bounds_error->addFnAttr(Attribute::Cold);
+  // Declare the allocator's runtime half
+  FunctionType *alloc_slow_type = FunctionType::get(PointerType::get(i64, 0), {i64}, false);
+  Function::Create(alloc_slow_type, Function::ExternalLinkage, "llama_alloc_slow", TheModule.get())->addFnAttr(Attribute::Cold);
+  FunctionType *llama_free_type = FunctionType::get(voi, {PointerType::get(i64, 0), i64}, false);
+  Function::Create(llama_free_type, Function::ExternalLinkage, "llama_free", TheModule.get());
+  // The C library expects bool and char arguments and results extended to a register
+  for (Function &func : TheModule->functions())
+  {
+    for (Argument &arg : func.args())
+    {
+      if (arg.getType() == i1 || arg.getType() == i8)
+      {
+        arg.addAttr(arg.getType() == i1 ? Attribute::ZExt : Attribute::SExt);
+      }
+    }
+    llvm::Type *ret = func.getReturnType();
+    if (ret == i1 || ret == i8)
+    {
+      func.addAttribute(AttributeList::ReturnIndex, ret == i1 ? Attribute::ZExt : Attribute::SExt);
+    }
+  }
+  llvm_allocator();
+  if (RC)
+  {
+    llvm_rc_runtime();
+  }
+  if (HashCons)
+  {
+    llvm_hash_cons_runtime();
+  }
   // Define and start the main function
   FunctionType *main_type = FunctionType::get(i64, {}, false);
   Function *main = Function::Create(main_type, Function::ExternalLinkage, "main", TheModule.get());
@@ -121,6 +331,10 @@ void Program::llvm_compile_and_dump(bool optimize, raw_fd_ostream *imm_file, raw
   // Emit the program code
   compile();
   Builder.CreateRet(c64(0));
+  if (GC)
+  {
+    llvm_gc_frames();
+  }
   // Verify the IR
   bool bad = verifyModule(*TheModule, &errs());
   if (bad)
@@ -132,44 +346,66 @@ void Program::llvm_compile_and_dump(bool optimize, raw_fd_ostream *imm_file, raw
     TheModule->print(errs(), nullptr);
     std::exit(1);
   }
-  // Optimize
-  TheFPM->run(*main);
+  // Record the chosen target on every function for the optimizer and the backend
+  for (Function &func : TheModule->functions())
+  {
+    if (!func.isDeclaration())
+    {
+      func.addFnAttr("target-cpu", CPU);
+      if (!Features.empty())
+      {
+        func.addFnAttr("target-features", Features);
+      }
+    }
+  }
+}
+
+void Program::llvm_optimize(int opt_level)
+{
+  // Optimize the whole module
+  if (opt_level > 0)
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(false, TheTargetMachine);
+    FAM.registerPass([&]
+                     { return PB.buildDefaultAAPipeline(); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PassBuilder::OptimizationLevel levels[] = {PassBuilder::OptimizationLevel::O0, PassBuilder::OptimizationLevel::O1,
+                                               PassBuilder::OptimizationLevel::O2, PassBuilder::OptimizationLevel::O3};
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(levels[opt_level]);
+    MPM.run(*TheModule, MAM);
+  }
+}
+
+void Program::llvm_emit(raw_pwrite_stream &out, bool object_code)
+{
+  legacy::PassManager pass;
+  if (TheTargetMachine->addPassesToEmitFile(pass, out, nullptr, object_code ? CGFT_ObjectFile : CGFT_AssemblyFile))
+  {
+    errs() << "TargetMachine can't emit a file of this type";
+    exit(1);
+  }
+  pass.run(*TheModule);
+}
+
+void Program::llvm_compile_and_dump(int opt_level, std::string CPU, std::string Features, raw_fd_ostream *imm_file, raw_fd_ostream *asm_file, bool object_code)
+{
+  llvm_compile(opt_level, CPU, Features, false);
+  llvm_optimize(opt_level);
   if (imm_file != nullptr) // Print out the IR
   {
     TheModule->print(*imm_file, nullptr);
   }
-  if (asm_file != nullptr) // Print out the Assembly
+  if (asm_file != nullptr) // Print out the Assembly or the object code
   {
-    std::string TargetTriple = sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmPrinters();
-    InitializeAllAsmParsers();
-    std::string Error;
-    const Target *TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
-    if (!TheTarget)
-    {
-      errs() << "Failed to get target: " << Error;
-      exit(1);
-    }
-    std::string CPU = "generic";
-    std::string Features = "";
-    TargetOptions opt;
-    Optional<Reloc::Model> RM = Optional<Reloc::Model>();
-    TargetMachine *TheTargetMachine = TheTarget->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
-    if (optimize)
-    {
-      TheTargetMachine->setOptLevel(CodeGenOpt::Aggressive);
-    }
-    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
-    legacy::PassManager pass;
-    if (TheTargetMachine->addPassesToEmitFile(pass, *asm_file, nullptr, CGFT_AssemblyFile))
-    {
-      errs() << "TargetMachine can't emit a file of this type";
-      exit(1);
-    }
-    pass.run(*TheModule);
+    llvm_emit(*asm_file, object_code);
   }
 }
 
@@ -187,9 +423,16 @@ void LetDef::compile() const
   {
     def->compile();
   }
-  for (Def *def : *def_vec)
+  std::set<std::string> prev = LiveAfter;
+  for (size_t i = 0; i < def_vec->size(); i++)
   {
-    def->compile2();
+    // Later definitions of the group still read the earlier ones
+    for (size_t j = i + 1; RC && j < def_vec->size(); j++)
+    {
+      (*def_vec)[j]->uses(LiveAfter);
+    }
+    (*def_vec)[i]->compile2();
+    LiveAfter = prev;
   }
 }
 
@@ -197,21 +440,23 @@ void NormalDef::compile() const
 {
   if (par_vec->size() == 0) // Constant
   {
-    llvm::Type *t = typ->compile();
-    new GlobalVariable(*TheModule, t, false, GlobalValue::PrivateLinkage, ConstantAggregateZero::get(t), id);
+    createVariable(id, typ->compile());
   }
   else // Function
   {
     std::vector<llvm::Type *> from = {};
+    for (const std::string &c : ft.lookup(id)->captures)
+    {
+      from.push_back(ft.localType(c)->compile());
+    }
     for (Par *par : *par_vec)
     {
-      llvm::Type *t = par->typ->compile();
-      from.push_back(t);
-      new GlobalVariable(*TheModule, t, false, GlobalValue::PrivateLinkage, ConstantAggregateZero::get(t), par->id);
+      from.push_back(par->typ->compile());
     }
     llvm::Type *to = typ->compile();
     FunctionType *fn_type = FunctionType::get(to, from, false);
-    Function::Create(fn_type, Function::ExternalLinkage, id, TheModule.get());
+    Function *func = Function::Create(fn_type, Function::InternalLinkage, id, TheModule.get());
+    func->setCallingConv(CallingConv::Fast);
   }
 }
 
@@ -221,64 +466,76 @@ void NormalDef::compile2() const
   if (par_vec->size() == 0) // Constant
   {
     Value *v = expr->compile();
-    GlobalVariable *var = TheModule->getGlobalVariable(id, true);
-    Builder.CreateStore(v, var);
+    Builder.CreateStore(v, getVariable(id));
+    if (owned(id) && LiveAfter.count(id) == 0)
+    {
+      drop(v);
+    }
   }
   else // Function
   {
-    std::vector<GlobalVariable *> global_vec;
-    std::vector<llvm::Type *> members;
-    auto start = std::prev(TheModule->global_end());
+    const std::vector<std::string> &captures = ft.lookup(id)->captures;
+    std::vector<Value *> outer_vec;
+    std::string PrevId = TailId;
+    BasicBlock *PrevLoopBB = LoopBB;
+    std::vector<Value *> PrevParams = LoopParams;
+    std::set<std::string> PrevLive = LiveAfter;
+    std::vector<std::pair<Value *, uint64_t>> PrevTokens = ReuseTokens;
+    std::map<std::string, ConstrEntry *> PrevShapes = KnownShape;
+    LiveAfter.clear();
+    ReuseTokens.clear();
+    KnownShape.clear();
+    std::set<std::string> body = usesOf(expr);
     Function *func = TheModule->getFunction(id);
     BasicBlock *PrevBB = Builder.GetInsertBlock();
-    BasicBlock *HeadBB = BasicBlock::Create(TheContext, "head", func);
     BasicBlock *BodyBB = BasicBlock::Create(TheContext, "body", func);
-    BasicBlock *TailBB = BasicBlock::Create(TheContext, "tail", func);
+    TailId = id;
+    LoopBB = BasicBlock::Create(TheContext, "loop", func);
+    LoopParams.clear();
     Builder.SetInsertPoint(BodyBB);
     Function::arg_iterator arg = func->arg_begin();
-    for (Par *par : *par_vec)
+    // Captured locals shadow the enclosing function's copies inside the body
+    for (const std::string &c : captures)
     {
-      GlobalVariable *var = TheModule->getGlobalVariable(par->id, true);
-      Builder.CreateStore(arg++, var);
-      global_vec.push_back(var);
-    }
-    Value *v = expr->compile();
-    Builder.CreateBr(TailBB);
-    Builder.SetInsertPoint(HeadBB);
-    for (auto global = ++start; global != TheModule->global_end(); global++)
-    {
-      if (!global->isConstant())
+      outer_vec.push_back(getVariable(c));
+      Value *var = createVariable(c, arg->getType());
+      Builder.CreateStore(arg, var);
+      if (owned(c) && body.count(c) == 0)
       {
-        global_vec.push_back(&*global);
+        drop(arg);
       }
+      arg++;
     }
-    for (GlobalVariable *global : global_vec)
+    for (Par *par : *par_vec)
     {
-      members.push_back(global->getValueType());
+      Value *var = createVariable(par->id, arg->getType());
+      Builder.CreateStore(arg++, var);
+      LoopParams.push_back(var);
     }
-    llvm::Type *t = StructType::create(TheContext, {members}, id + "_bak");
-    DataLayout dataLayout("");
-    Value *size = c64(dataLayout.getTypeSizeInBits(t) / 8);
-    Value *alloc = Builder.CreateCall(TheModule->getFunction("malloc"), {size});
-    Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(t, 0));
-    int i = 0;
-    for (GlobalVariable *global : global_vec)
+    Builder.CreateBr(LoopBB);
+    Builder.SetInsertPoint(LoopBB);
+    // Parameters the body never reads die on every iteration
+    for (Par *par : *par_vec)
     {
-      Value *MemberPointer = Builder.CreateStructGEP(t, ptr, i++);
-      Builder.CreateStore(Builder.CreateLoad(global), MemberPointer);
+      if (owned(par->id) && body.count(par->id) == 0)
+      {
+        drop(Builder.CreateLoad(getVariable(par->id)));
+      }
     }
-    Builder.CreateBr(BodyBB);
-    Builder.SetInsertPoint(TailBB);
-    i = 0;
-    for (GlobalVariable *global : global_vec)
+    Value *v = expr->compile();
+    releaseTokens(0);
+    Builder.CreateRet(v);
+    for (size_t i = 0; i < captures.size(); i++)
     {
-      Value *MemberPointer = Builder.CreateStructGEP(t, ptr, i++);
-      Builder.CreateStore(Builder.CreateLoad(MemberPointer), global);
+      NamedValues[captures[i]] = outer_vec[i];
     }
-    Builder.CreateCall(TheModule->getFunction("free"), {alloc});
-    Builder.CreateRet(v);
+    TailId = PrevId;
+    LoopBB = PrevLoopBB;
+    LoopParams = PrevParams;
+    LiveAfter = PrevLive;
+    ReuseTokens = PrevTokens;
+    KnownShape = PrevShapes;
     Builder.SetInsertPoint(PrevBB);
-    TheFPM->run(*func);
   }
 }
 
@@ -287,31 +544,78 @@ void MutableDef::compile() const
   llvm::Type *t = typ->compile();
   llvm::Type *pt = PointerType::get(t, 0);
   std::vector<Value *> value_vec;
-  DataLayout dataLayout("");
-  Value *size = c64(dataLayout.getTypeSizeInBits(t) / 8);
+  Value *elems = sizeOf(t);
+  Value *size = elems;
   if (expr_vec != nullptr) // Array
   {
-    for (Expr *e : *expr_vec)
+    value_vec = compileArgs(*expr_vec);
+    for (Value *v : value_vec)
     {
-      Value *v = e->compile();
-      value_vec.push_back(v);
-      size = Builder.CreateMul(size, v);
+      elems = Builder.CreateMul(elems, v);
+    }
+    // Room for the descriptor stored in front of the elements
+    size = Builder.CreateAdd(elems, Builder.CreateMul(sizeOf(i64), c64(2 * expr_vec->size() - 1)));
+  }
+  Value *var = createVariable(id, pt);
+  // Small arrays of a constant size that do not escape live in the frame
+  uint64_t count = 1;
+  bool fixed = !escapes(id);
+  std::vector<int64_t> dims;
+  for (size_t i = 0; fixed && expr_vec != nullptr && i < expr_vec->size(); i++)
+  {
+    int n;
+    fixed = (*expr_vec)[i]->get_int(n) && n > 0 && (count *= n) * TheModule->getDataLayout().getTypeAllocSize(t) <= MaxFrameArray;
+    dims.push_back(n);
+  }
+  Value *alloc;
+  if (fixed && expr_vec != nullptr)
+  {
+    // Descriptor: dim k at -k, then the row-major stride of dim k < n at
+    // -(n + k). Known here, so it is written along with the frame
+    int n = expr_vec->size();
+    std::vector<int64_t> header(2 * n - 1);
+    for (int k = 1; k <= n; k++)
+    {
+      header[2 * n - 1 - k] = dims[k - 1];
+    }
+    int64_t stride = 1;
+    for (int k = n - 1; k >= 1; k--)
+    {
+      stride *= dims[k];
+      header[n - 1 - k] = stride;
     }
-    size = Builder.CreateAdd(size, c64(expr_vec->size()));
+    alloc = allocateFrame(StructType::get(TheContext, {ArrayType::get(i64, 2 * n - 1), ArrayType::get(t, count)}), header);
+  }
+  else if (fixed)
+  {
+    alloc = allocateFrame(t);
+  }
+  else
+  {
+    alloc = expr_vec != nullptr ? allocateArray(size, t, expr_vec->size()) : allocate(t);
   }
-  GlobalVariable *var = new GlobalVariable(*TheModule, pt, false, GlobalValue::PrivateLinkage, ConstantAggregateZero::get(pt), id);
-  Value *alloc = Builder.CreateCall(TheModule->getFunction("malloc"), {size});
   if (expr_vec != nullptr)
   {
-    // Store dims
-    alloc = Builder.CreateGEP(alloc, {c64(expr_vec->size())});
-    int i = 0;
-    for (Value *v : value_vec)
+    int n = expr_vec->size();
+    alloc = Builder.CreateGEP(alloc, {c64(2 * n - 1)});
+    // Otherwise it is stored in front of the elements now
+    for (int k = 1; !fixed && k <= n; k++)
+    {
+      Builder.CreateStore(value_vec[k - 1], Builder.CreateGEP(alloc, {c64(-k)}));
+    }
+    Value *stride = c64(1);
+    for (int k = n - 1; !fixed && k >= 1; k--)
     {
-      Builder.CreateStore(v, Builder.CreateGEP(alloc, {c64(--i)}));
+      stride = Builder.CreateMul(stride, value_vec[k]);
+      Builder.CreateStore(stride, Builder.CreateGEP(alloc, {c64(-(n + k))}));
     }
   }
   Value *ptr = Builder.CreateBitCast(alloc, pt);
+  if (RC && isADT(typ))
+  {
+    // Assignments drop the previous value, so there must be none at first
+    Builder.CreateMemSet(ptr, c8(0), elems, MaybeAlign(8));
+  }
   Builder.CreateStore(ptr, var);
 }
 
@@ -329,143 +633,385 @@ void TypeDef::compile() const
 
 void TDef::compile() const
 {
+  if (unboxed(id))
+  {
+    return;
+  }
   FunctionType *fn_type = FunctionType::get(i1, {PointerType::get(i64, 0), PointerType::get(i64, 0)}, false);
-  Function::Create(fn_type, Function::ExternalLinkage, id + "_cmp", TheModule.get());
+  Function::Create(fn_type, Function::InternalLinkage, id + "_cmp", TheModule.get());
+  std::set<std::string> seen;
+  if (HashCons && immutable(new Type_id(id), seen))
+  {
+    Interned.insert(id);
+  }
+  // One step of the comparison, run by llama_equal
+  FunctionType *step_type = FunctionType::get(i1, {PointerType::get(i64, 0), PointerType::get(i64, 0), PointerType::get(i8, 0)}, false);
+  Function *step = Function::Create(step_type, Function::InternalLinkage, id + "_step", TheModule.get());
+  step->addAttribute(AttributeList::ReturnIndex, Attribute::ZExt);
 }
 
 void TDef::compile2() const
 {
-  Function *func = TheModule->getFunction(id + "_cmp");
-  std::vector<Value *> value_vec;
-  std::vector<BasicBlock *> block_vec;
+  if (unboxed(id))
+  {
+    (*constr_vec)[0]->compile();
+    return;
+  }
   BasicBlock *PrevBB = Builder.GetInsertBlock();
-  BasicBlock *HeadBB = BasicBlock::Create(TheContext, "head", func);
+  // A cell equals itself unless a float in it is NaN
+  std::set<std::string> seen;
+  bool same = !hasFloat(new Type_id(id), seen);
+  Function *func = TheModule->getFunction(id + "_step");
   BasicBlock *BodyBB = BasicBlock::Create(TheContext, "body", func);
-  BasicBlock *ThenBB = nullptr;
-  BasicBlock *ElseBB = nullptr;
-  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endif", func);
+  BasicBlock *TagBB = BasicBlock::Create(TheContext, "tag", func);
+  BasicBlock *TrueBB = BasicBlock::Create(TheContext, "true", func);
+  BasicBlock *FalseBB = BasicBlock::Create(TheContext, "false", func);
   Builder.SetInsertPoint(BodyBB);
   Function::arg_iterator arg = func->arg_begin();
   Value *l_ptr = arg++;
-  Value *r_ptr = arg;
+  Value *r_ptr = arg++;
+  Value *stack = arg;
+  Builder.CreateCondBr(same ? Builder.CreateICmpEQ(l_ptr, r_ptr) : c1(false), TrueBB, TagBB);
+  Builder.SetInsertPoint(TagBB);
+  Value *l_tag = loadTag(l_ptr, id);
+  Value *r_tag = loadTag(r_ptr, id);
+  BasicBlock *SwitchBB = BasicBlock::Create(TheContext, "switch", func);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(l_tag, r_tag), SwitchBB, FalseBB);
+  Builder.SetInsertPoint(SwitchBB);
+  SwitchInst *sw = Builder.CreateSwitch(l_tag, TrueBB, constr_vec->size());
   for (Constr *constr : *constr_vec)
   {
     constr->compile();
-    std::string str = "";
-    for (auto it = constr->Id.rbegin(); it != constr->Id.rend(); ++it)
+    if (constr->entry->fields.empty())
     {
-      if (*it == '_')
-      {
-        break;
-      }
-      str = *it + str;
+      continue;
     }
-    int num = stoi(str);
-    ThenBB = BasicBlock::Create(TheContext, "then", func);
-    ElseBB = BasicBlock::Create(TheContext, "else", func);
-    Value *cond = Builder.CreateICmpEQ(Builder.CreateLoad(l_ptr), c64(num));
-    Builder.CreateCondBr(cond, ThenBB, ElseBB);
-    Builder.SetInsertPoint(ThenBB);
-    value_vec.push_back(Builder.CreateCall(TheModule->getFunction(constr->Id + "_cmp"), {l_ptr, r_ptr}));
-    block_vec.push_back(ThenBB);
-    Builder.CreateBr(AfterBB);
-    Builder.SetInsertPoint(ElseBB);
+    BasicBlock *CaseBB = BasicBlock::Create(TheContext, "case", func);
+    sw->addCase(tagOf(constr->entry), CaseBB);
+    Builder.SetInsertPoint(CaseBB);
+    Builder.CreateRet(Builder.CreateCall(TheModule->getFunction(constr->Id + "_cmp"), {l_ptr, r_ptr, stack}));
   }
-  value_vec.push_back(c1(false));
-  block_vec.push_back(ElseBB);
-  Builder.CreateBr(AfterBB);
-  Builder.SetInsertPoint(HeadBB);
-  Value *cond = Builder.CreateICmpEQ(Builder.CreateLoad(l_ptr), Builder.CreateLoad(r_ptr));
-  Builder.CreateCondBr(cond, BodyBB, ElseBB);
-  Builder.SetInsertPoint(AfterBB);
-  PHINode *phi = Builder.CreatePHI(i1, value_vec.size());
-  for (size_t i = 0; i < value_vec.size(); i++)
+  Builder.SetInsertPoint(TrueBB);
+  Builder.CreateRet(c1(true));
+  Builder.SetInsertPoint(FalseBB);
+  Builder.CreateRet(c1(false));
+  // Entry point, which leaves identical values to no call
+  func = TheModule->getFunction(id + "_cmp");
+  BodyBB = BasicBlock::Create(TheContext, "body", func);
+  Builder.SetInsertPoint(BodyBB);
+  arg = func->arg_begin();
+  l_ptr = arg++;
+  r_ptr = arg;
+  if (Interned.count(id) > 0)
   {
-    phi->addIncoming(value_vec[i], block_vec[i]);
+    // Equal values share their cell
+    Builder.CreateRet(Builder.CreateICmpEQ(l_ptr, r_ptr));
+    Builder.SetInsertPoint(PrevBB);
+    return;
   }
-  Builder.CreateRet(phi);
+  BasicBlock *WalkBB = BasicBlock::Create(TheContext, "walk", func);
+  TrueBB = BasicBlock::Create(TheContext, "true", func);
+  Builder.CreateCondBr(same ? Builder.CreateICmpEQ(l_ptr, r_ptr) : c1(false), TrueBB, WalkBB);
+  Builder.SetInsertPoint(WalkBB);
+  Value *step = Builder.CreateBitCast(TheModule->getFunction(id + "_step"), PointerType::get(i8, 0));
+  Builder.CreateRet(Builder.CreateCall(TheModule->getFunction("llama_equal"), {l_ptr, r_ptr, step}));
+  Builder.SetInsertPoint(TrueBB);
+  Builder.CreateRet(c1(true));
   Builder.SetInsertPoint(PrevBB);
-  TheFPM->run(*func);
 }
 
-void Constr::compile() const
+bool AST::hasFloat(::Type *t, std::set<std::string> &seen) const
+{
+  while (t->get_type() == type_ref)
+  {
+    t = t->getChild1();
+  }
+  if (t->get_type() == type_float)
+  {
+    return true;
+  }
+  for (int i = 0; t->get_type() == type_tuple && i < t->getDim(); i++)
+  {
+    if (hasFloat(t->getChild(i), seen))
+    {
+      return true;
+    }
+  }
+  if (t->get_type() != type_id || !seen.insert(t->get_id()).second)
+  {
+    return false;
+  }
+  for (ConstrEntry *c : tt.getConstructors(t->get_id()))
+  {
+    for (::Type *field : c->fields)
+    {
+      if (hasFloat(field, seen))
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void AST::compareValues(Value *l, Value *r, ::Type *typ, Value *stack, BasicBlock *FalseBB, bool physical) const
 {
-  std::string str = "";
-  for (auto it = Id.rbegin(); it != Id.rend(); ++it)
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  while (!physical && typ->get_type() == type_ref)
   {
-    if (*it == '_')
+    typ = typ->getChild1();
+    l = Builder.CreateLoad(l);
+    r = Builder.CreateLoad(r);
+  }
+  Value *cond;
+  switch (typ->get_type())
+  {
+  case type_unit:
+    return;
+  case type_float:
+    cond = Builder.CreateFCmpOEQ(l, r);
+    break;
+  case type_id:
+  {
+    if (physical || unboxed(typ->get_id()) || interned(typ))
     {
+      cond = Builder.CreateICmpEQ(l, r);
       break;
     }
-    str = *it + str;
+    if (stack == nullptr)
+    {
+      cond = Builder.CreateCall(TheModule->getFunction(typ->get_id() + "_cmp"), {l, r});
+      break;
+    }
+    std::set<std::string> seen;
+    BasicBlock *PushBB = BasicBlock::Create(TheContext, "push", TheFunction);
+    BasicBlock *NextBB = BasicBlock::Create(TheContext, "next", TheFunction);
+    Builder.CreateCondBr(hasFloat(typ, seen) ? c1(false) : Builder.CreateICmpEQ(l, r), NextBB, PushBB);
+    Builder.SetInsertPoint(PushBB);
+    Value *step = Builder.CreateBitCast(TheModule->getFunction(typ->get_id() + "_step"), PointerType::get(i8, 0));
+    Builder.CreateCall(TheModule->getFunction("llama_eq_push"), {stack, l, r, step});
+    Builder.CreateBr(NextBB);
+    Builder.SetInsertPoint(NextBB);
+    return;
+  }
+  case type_func:
+    cond = Builder.CreateAnd(Builder.CreateICmpEQ(Builder.CreateExtractValue(l, 0), Builder.CreateExtractValue(r, 0)),
+                             Builder.CreateICmpEQ(Builder.CreateExtractValue(l, 1), Builder.CreateExtractValue(r, 1)));
+    break;
+  case type_tuple:
+    // Its components are compared as if they were fields of their own
+    for (int i = 0; i < typ->getDim(); i++)
+    {
+      compareValues(Builder.CreateExtractValue(l, i), Builder.CreateExtractValue(r, i), typ->getChild(i), stack, FalseBB, physical);
+    }
+    return;
+  default:
+    cond = Builder.CreateICmpEQ(l, r);
+    break;
+  }
+  BasicBlock *NextBB = BasicBlock::Create(TheContext, "next", TheFunction);
+  Builder.CreateCondBr(cond, NextBB, FalseBB);
+  Builder.SetInsertPoint(NextBB);
+}
+
+Value *AST::tupleEq(Value *l, Value *r, ::Type *t, bool physical) const
+{
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *FalseBB = BasicBlock::Create(TheContext, "tuple_ne", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "tuple_cmp", TheFunction);
+  compareValues(l, r, t, nullptr, FalseBB, physical);
+  BasicBlock *TrueBB = Builder.GetInsertBlock();
+  Builder.CreateBr(AfterBB);
+  Builder.SetInsertPoint(FalseBB);
+  Builder.CreateBr(AfterBB);
+  Builder.SetInsertPoint(AfterBB);
+  PHINode *phi = Builder.CreatePHI(i1, 2, "eqtmp");
+  phi->addIncoming(c1(true), TrueBB);
+  phi->addIncoming(c1(false), FalseBB);
+  return phi;
+}
+
+llvm::IntegerType *AST::tagType(const std::string &id) const
+{
+  size_t count = tt.getConstructors(id).size();
+  return IntegerType::get(TheContext, count <= 1 << 8 ? 8 : count <= 1 << 16 ? 16 : 32);
+}
+
+ConstantInt *AST::tagOf(ConstrEntry *e) const
+{
+  return ConstantInt::get(tagType(e->type), e->tag);
+}
+
+bool AST::unboxed(const std::string &id) const
+{
+  std::vector<ConstrEntry *> &constrs = tt.getConstructors(id);
+  if (constrs.size() != 1 || constrs[0]->fields.size() != 1)
+  {
+    return false;
+  }
+  main_type t = constrs[0]->fields[0]->get_type();
+  return t == type_int || t == type_char || t == type_bool;
+}
+
+bool AST::tagged(const std::string &id) const
+{
+  return tt.getConstructors(id).size() <= PointerTags;
+}
+
+Value *AST::tagPtr(Value *cell, ConstrEntry *e) const
+{
+  if (!tagged(e->type) || e->tag == 0)
+  {
+    return cell;
+  }
+  Value *byte = Builder.CreateGEP(Builder.CreateBitCast(cell, PointerType::get(i8, 0)), c64(e->tag));
+  return Builder.CreateBitCast(byte, PointerType::get(i64, 0));
+}
+
+Value *AST::loadTag(Value *v, const std::string &id) const
+{
+  if (tagged(id))
+  {
+    Value *bits = Builder.CreateAnd(Builder.CreatePtrToInt(v, i64), c64(PointerTags - 1));
+    return Builder.CreateTrunc(bits, tagType(id), "tag");
   }
-  int num = stoi(str);
+  return Builder.CreateLoad(Builder.CreateBitCast(v, PointerType::get(tagType(id), 0)), "tag");
+}
+
+Value *AST::fieldPtr(ConstrEntry *e, Value *v, size_t i) const
+{
+  // The tag is known here, so removing it only shifts the offset
+  Value *cell = v;
+  if (tagged(e->type) && e->tag != 0)
+  {
+    cell = Builder.CreateGEP(Builder.CreateBitCast(v, PointerType::get(i8, 0)), c64(-e->tag));
+  }
+  Value *ptr = Builder.CreateBitCast(cell, PointerType::get(e->structType, 0));
+  return Builder.CreateStructGEP(e->structType, ptr, e->slots[i]);
+}
+
+void Constr::compile() const
+{
   std::vector<llvm::Type *> from = {};
-  std::vector<llvm::Type *> members = {i64};
   for (::Type *typ : *type_vec)
   {
-    llvm::Type *t = typ->compile();
-    from.push_back(t);
-    members.push_back(t);
+    from.push_back(typ->compile());
+  }
+  // The fields follow the tag by increasing alignment, so the small ones
+  // fill the space after the tag and no padding is left between them. A
+  // tag kept in the pointers takes no room in the record
+  const DataLayout &DL = TheModule->getDataLayout();
+  std::vector<unsigned> order(from.size());
+  for (unsigned k = 0; k < order.size(); k++)
+  {
+    order[k] = k;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+                   { return DL.getABITypeAlignment(from[a]) < DL.getABITypeAlignment(from[b]); });
+  std::vector<llvm::Type *> members;
+  if (!tagged(id))
+  {
+    members.push_back(tagType(id));
+  }
+  entry->slots.assign(from.size(), 0);
+  for (unsigned k : order)
+  {
+    entry->slots[k] = members.size();
+    members.push_back(from[k]);
+  }
+  StructType *t = StructType::create(TheContext, {members}, Id);
+  entry->structType = t;
+  if (unboxed(id))
+  {
+    // Building it is the identity, and its field is the value itself
+    return;
   }
-  llvm::Type *t = StructType::create(TheContext, {members}, Id);
-  // Constructor
-  FunctionType *fn_type = FunctionType::get(PointerType::get(i64, 0), from, false);
-  Function *func = Function::Create(fn_type, Function::ExternalLinkage, Id, TheModule.get());
   BasicBlock *PrevBB = Builder.GetInsertBlock();
-  BasicBlock *BodyBB = BasicBlock::Create(TheContext, "body", func);
-  Builder.SetInsertPoint(BodyBB);
-  DataLayout dataLayout("");
-  Value *size = c64(dataLayout.getTypeSizeInBits(t) / 8);
-  Value *alloc = Builder.CreateCall(TheModule->getFunction("malloc"), {size});
-  Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(t, 0));
-  Value *MemberPointer = Builder.CreateStructGEP(t, ptr, 0);
-  Builder.CreateStore(c64(num), MemberPointer);
-  int i = 1;
-  for (Function::arg_iterator arg = func->arg_begin(); arg != func->arg_end(); arg++)
-  {
-    MemberPointer = Builder.CreateStructGEP(t, ptr, i++);
-    Builder.CreateStore(arg, MemberPointer);
-  }
-  Builder.CreateRet(alloc);
-  // Comparator
-  fn_type = FunctionType::get(i1, {PointerType::get(i64, 0), PointerType::get(i64, 0)}, false);
-  func = Function::Create(fn_type, Function::ExternalLinkage, Id + "_cmp", TheModule.get());
-  BodyBB = BasicBlock::Create(TheContext, "body", func);
-  Builder.SetInsertPoint(BodyBB);
-  Function::arg_iterator arg = func->arg_begin();
-  Value *l_ptr = Builder.CreateBitCast(arg++, PointerType::get(t, 0));
-  Value *r_ptr = Builder.CreateBitCast(arg, PointerType::get(t, 0));
-  Value *cond = c1(true);
-  i = 1;
-  for (::Type *typ : *type_vec)
+  BasicBlock *BodyBB;
+  Function *func;
+  if (type_vec->empty())
   {
-    Value *l = Builder.CreateLoad(Builder.CreateStructGEP(t, l_ptr, i));
-    Value *r = Builder.CreateLoad(Builder.CreateStructGEP(t, r_ptr, i++));
-    while (typ->get_type() == type_ref)
+    // A single constant instance, so building it is free and
+    // matching it is a pointer compare
+    Constant *init = tagged(id) ? ConstantStruct::get(t, {}) : ConstantStruct::get(t, {tagOf(entry)});
+    if (RC)
     {
-      typ = typ->getChild1();
-      l = Builder.CreateLoad(l);
-      r = Builder.CreateLoad(r);
+      // Behind a header whose count of 0 keeps it alive
+      init = ConstantStruct::getAnon({c64(0), c64(0), init});
     }
-    switch (typ->get_type())
+    GlobalVariable *gv = new GlobalVariable(*TheModule, init->getType(), true, GlobalValue::PrivateLinkage, init, Id);
+    gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    gv->setAlignment(Align(PointerTags));
+    Constant *value = gv;
+    if (RC)
     {
-    case type_unit:
-      continue;
-    case type_float:
-      cond = Builder.CreateAnd(cond, Builder.CreateFCmpOEQ(l, r));
-      continue;
-    case type_id:
-      cond = Builder.CreateAnd(cond, Builder.CreateCall(TheModule->getFunction(typ->get_id() + "_cmp"), {l, r}));
-      continue;
-    default:
-      cond = Builder.CreateAnd(cond, Builder.CreateICmpEQ(l, r));
-      continue;
+      value = ConstantExpr::getInBoundsGetElementPtr(init->getType(), gv, ArrayRef<Constant *>{c64(0), c32(2)});
+    }
+    if (tagged(id))
+    {
+      value = ConstantExpr::getGetElementPtr(i8, ConstantExpr::getBitCast(value, PointerType::get(i8, 0)), c64(entry->tag));
+    }
+    entry->value = ConstantExpr::getBitCast(value, PointerType::get(i64, 0));
+  }
+  else
+  {
+    // Constructor, which with -frc takes a cell to reuse or null
+    if (RC)
+    {
+      from.insert(from.begin(), PointerType::get(i64, 0));
+    }
+    FunctionType *fn_type = FunctionType::get(PointerType::get(i64, 0), from, false);
+    func = Function::Create(fn_type, Function::InternalLinkage, Id, TheModule.get());
+    entry->func = func;
+    BodyBB = BasicBlock::Create(TheContext, "body", func);
+    Builder.SetInsertPoint(BodyBB);
+    Function::arg_iterator fields = func->arg_begin() + (RC ? 1 : 0);
+    std::vector<Value *> args;
+    for (Function::arg_iterator arg = fields; arg != func->arg_end(); arg++)
+    {
+      args.push_back(keep(arg));
     }
+    if (Interned.count(id) > 0)
+    {
+      Builder.CreateRet(internCell(entry, args));
+    }
+    else
+    {
+      Value *alloc = RC ? allocateCell(entry, func->arg_begin()) : allocate(t);
+      Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(t, 0));
+      if (!tagged(id))
+      {
+        Builder.CreateStore(tagOf(entry), Builder.CreateStructGEP(t, ptr, 0));
+      }
+      Value *v = tagPtr(alloc, entry);
+      for (size_t i = 0; i < args.size(); i++)
+      {
+        Builder.CreateStore(args[i], fieldPtr(entry, v, i));
+      }
+      Builder.CreateRet(v);
+    }
+  }
+  // Comparison of the fields of two cells with this tag, stopping at the
+  // first mismatch and leaving the fields that are cells to the stack
+  FunctionType *fn_type = FunctionType::get(i1, {PointerType::get(i64, 0), PointerType::get(i64, 0), PointerType::get(i8, 0)}, false);
+  func = Function::Create(fn_type, Function::InternalLinkage, Id + "_cmp", TheModule.get());
+  BodyBB = BasicBlock::Create(TheContext, "body", func);
+  BasicBlock *FalseBB = BasicBlock::Create(TheContext, "false", func);
+  Builder.SetInsertPoint(BodyBB);
+  Function::arg_iterator arg = func->arg_begin();
+  Value *l_ptr = Builder.CreateBitCast(arg++, PointerType::get(t, 0));
+  Value *r_ptr = Builder.CreateBitCast(arg++, PointerType::get(t, 0));
+  Value *stack = arg;
+  for (size_t i = 0; i < type_vec->size(); i++)
+  {
+    Value *l = Builder.CreateLoad(fieldPtr(entry, l_ptr, i));
+    Value *r = Builder.CreateLoad(fieldPtr(entry, r_ptr, i));
+    compareValues(l, r, (*type_vec)[i], stack, FalseBB);
   }
-  Builder.CreateRet(cond);
+  Builder.CreateRet(c1(true));
+  Builder.SetInsertPoint(FalseBB);
+  Builder.CreateRet(c1(false));
   Builder.SetInsertPoint(PrevBB);
-  TheFPM->run(*func);
 }
 
 llvm::Type *Type_Unit::compile() const
@@ -495,8 +1041,9 @@ llvm::Type *Type_Float::compile() const
 
 llvm::Type *Type_Func::compile() const
 {
+  // A closure: code taking the environment first, and the environment
   std::vector<::Type *> tmp_vec = {from};
-  std::vector<llvm::Type *> from_vec = {};
+  std::vector<llvm::Type *> from_vec = {PointerType::get(i8, 0)};
   ::Type *tmp = to;
   while (tmp->get_type() == type_func)
   {
@@ -509,7 +1056,7 @@ llvm::Type *Type_Func::compile() const
   }
   FunctionType *fn_type = FunctionType::get(tmp->compile(), from_vec, false);
   PointerType *fn_ptr_type = PointerType::getUnqual(fn_type);
-  return fn_ptr_type;
+  return StructType::get(TheContext, {fn_ptr_type, PointerType::get(i8, 0)});
 }
 
 llvm::Type *Type_Ref::compile() const
@@ -524,9 +1071,23 @@ llvm::Type *Type_Array::compile() const
 
 llvm::Type *Type_id::compile() const
 {
+  if (unboxed(id))
+  {
+    return tt.getConstructors(id)[0]->fields[0]->compile();
+  }
   return PointerType::get(i64, 0);
 }
 
+llvm::Type *Type_Tuple::compile() const
+{
+  std::vector<llvm::Type *> elems;
+  for (::Type *t : *type_vec)
+  {
+    elems.push_back(t->compile());
+  }
+  return StructType::get(TheContext, elems);
+}
+
 llvm::Type *Type_Undefined::compile() const
 {
   return typ == nullptr ? i64 : typ->compile();
@@ -589,12 +1150,17 @@ Value *UnOp::compile() const
   case unop_float_minus:
     return Builder.CreateFNeg(v, "fnegtmp");
   case unop_exclamation:
-    return Builder.CreateLoad(v, "dereftmp");
+    v = Builder.CreateLoad(v, "dereftmp");
+    if (RC && isADT(typ))
+    {
+      dup(v);
+    }
+    return keep(v);
   case unop_not:
     return Builder.CreateNot(v, "nottmp");
   case unop_delete:
-    v = Builder.CreateBitCast(v, PointerType::get(i64, 0));
-    return Builder.CreateCall(TheModule->getFunction("free"), {v});
+    deallocate(v, v->getType()->getPointerElementType());
+    return cvoid();
   default:
     return cvoid();
   }
@@ -602,7 +1168,7 @@ Value *UnOp::compile() const
 
 Value *BinOp::compile() const
 {
-  Value *l = left->compile();
+  Value *l = compileLive(left, usesOf(right));
   ::Type *l_typ = left->typ;
   if (op == binop_and)
   {
@@ -616,6 +1182,10 @@ Value *BinOp::compile() const
     ThenBB = Builder.GetInsertBlock();
     Builder.CreateBr(AfterBB);
     Builder.SetInsertPoint(ElseBB);
+    size_t mark = ReuseTokens.size();
+    dropVars(usesOf(right));
+    releaseTokens(mark);
+    ElseBB = Builder.GetInsertBlock();
     Builder.CreateBr(AfterBB);
     Builder.SetInsertPoint(AfterBB);
     PHINode *phi = Builder.CreatePHI(typ->compile(), 2, "phi");
@@ -631,6 +1201,10 @@ Value *BinOp::compile() const
     BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endif", TheFunction);
     Builder.CreateCondBr(l, ThenBB, ElseBB);
     Builder.SetInsertPoint(ThenBB);
+    size_t mark = ReuseTokens.size();
+    dropVars(usesOf(right));
+    releaseTokens(mark);
+    ThenBB = Builder.GetInsertBlock();
     Builder.CreateBr(AfterBB);
     Builder.SetInsertPoint(ElseBB);
     Value *r = right->compile();
@@ -643,6 +1217,22 @@ Value *BinOp::compile() const
     return phi;
   }
   Value *r = right->compile();
+  if (RC && isADT(l_typ) && op != binop_semicolon)
+  {
+    // Comparisons only look at their operands
+    Value *eq = nullptr;
+    if (op == binop_struct_eq || op == binop_struct_ne)
+    {
+      eq = Builder.CreateCall(TheModule->getFunction(l_typ->get_id() + "_cmp"), {l, r}, "eqtmp");
+    }
+    else
+    {
+      eq = Builder.CreateICmpEQ(l, r, "eqtmp");
+    }
+    drop(l);
+    drop(r);
+    return op == binop_struct_eq || op == binop_phys_eq ? eq : Builder.CreateNot(eq, "netmp");
+  }
   switch (op)
   {
   case binop_plus:
@@ -679,7 +1269,13 @@ Value *BinOp::compile() const
     case type_float:
       return Builder.CreateFCmpOEQ(l, r, "eqtmp");
     case type_id:
+      if (unboxed(l_typ->get_id()) || interned(l_typ))
+      {
+        return Builder.CreateICmpEQ(l, r, "eqtmp");
+      }
       return Builder.CreateCall(TheModule->getFunction(l_typ->get_id() + "_cmp"), {l, r}, "eqtmp");
+    case type_tuple:
+      return tupleEq(l, r, l_typ);
     default:
       return Builder.CreateICmpEQ(l, r, "eqtmp");
     }
@@ -697,7 +1293,13 @@ Value *BinOp::compile() const
     case type_float:
       return Builder.CreateFCmpONE(l, r, "netmp");
     case type_id:
+      if (unboxed(l_typ->get_id()) || interned(l_typ))
+      {
+        return Builder.CreateICmpNE(l, r, "netmp");
+      }
       return Builder.CreateNot(Builder.CreateCall(TheModule->getFunction(l_typ->get_id() + "_cmp"), {l, r}), "netmp");
+    case type_tuple:
+      return Builder.CreateNot(tupleEq(l, r, l_typ), "netmp");
     default:
       return Builder.CreateICmpNE(l, r, "netmp");
     }
@@ -708,6 +1310,9 @@ Value *BinOp::compile() const
       return c1(true);
     case type_float:
       return Builder.CreateFCmpOEQ(l, r, "eqtmp");
+    case type_tuple:
+      // A tuple has no identity of its own, but its components do
+      return tupleEq(l, r, l_typ, true);
     default:
       return Builder.CreateICmpEQ(l, r, "eqtmp");
     }
@@ -718,6 +1323,8 @@ Value *BinOp::compile() const
       return c1(true);
     case type_float:
       return Builder.CreateFCmpONE(l, r, "netmp");
+    case type_tuple:
+      return Builder.CreateNot(tupleEq(l, r, l_typ, true), "netmp");
     default:
       return Builder.CreateICmpNE(l, r, "netmp");
     }
@@ -746,9 +1353,20 @@ Value *BinOp::compile() const
     }
     return Builder.CreateICmpSGE(l, r, "getmp");
   case binop_assign:
+    if (RC && isADT(right->typ))
+    {
+      Value *old = Builder.CreateLoad(l, "old");
+      Builder.CreateStore(r, l);
+      drop(old);
+      return cvoid();
+    }
     Builder.CreateStore(r, l);
     return cvoid();
   case binop_semicolon:
+    if (RC && isADT(l_typ))
+    {
+      drop(l);
+    }
     return r;
   default:
     return cvoid();
@@ -758,106 +1376,307 @@ Value *BinOp::compile() const
 Value *id_Expr::compile() const
 {
   // Constant or Variable
-  GlobalVariable *var = TheModule->getGlobalVariable(id, true);
+  Value *var = getVariable(id);
   if (var != nullptr)
   {
-    return Builder.CreateLoad(var, "idtmp");
+    Value *v = Builder.CreateLoad(var, "idtmp");
+    // The last use of a local takes its reference, the others copy it
+    if (RC && isADT(typ) && (!owned(id) || LiveAfter.count(id) > 0))
+    {
+      dup(v);
+    }
+    return v;
   }
   // Function
   Function *func = TheModule->getFunction(id);
   if (func != nullptr)
   {
-    FunctionType *fn_type = func->getFunctionType();
-    PointerType *fn_ptr_type = PointerType::getUnqual(fn_type);
-    Value *fptr = ConstantExpr::getBitCast(func, fn_ptr_type);
-    return fptr;
+    return keep(closure(func));
   }
   return nullptr;
 }
 
+Value *id_Expr::closure(Function *func) const
+{
+  FunctionEntry *fe = ft.lookup(id);
+  std::vector<Value *> value_vec;
+  std::vector<llvm::Type *> members;
+  if (fe != nullptr)
+  {
+    for (const std::string &c : fe->captures)
+    {
+      Value *v = Builder.CreateLoad(getVariable(c));
+      if (owned(c))
+      {
+        dup(v);
+      }
+      value_vec.push_back(v);
+      members.push_back(v->getType());
+    }
+  }
+  StructType *env_type = StructType::get(TheContext, members);
+  PointerType *env_ptr_type = PointerType::get(i8, 0);
+  // Only the captured locals are copied into the environment
+  Value *env = ConstantPointerNull::get(env_ptr_type);
+  if (!value_vec.empty())
+  {
+    Value *alloc = allocate(env_type);
+    Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(env_type, 0));
+    for (size_t i = 0; i < value_vec.size(); i++)
+    {
+      Builder.CreateStore(value_vec[i], Builder.CreateStructGEP(env_type, ptr, i));
+    }
+    env = Builder.CreateBitCast(alloc, env_ptr_type);
+  }
+  // The code unpacks the environment and calls the lifted function
+  Function *code = TheModule->getFunction(id + "_clo");
+  if (code == nullptr)
+  {
+    std::vector<llvm::Type *> from = {env_ptr_type};
+    for (auto param = func->arg_begin() + members.size(); param != func->arg_end(); param++)
+    {
+      from.push_back(param->getType());
+    }
+    FunctionType *fn_type = FunctionType::get(func->getReturnType(), from, false);
+    code = Function::Create(fn_type, Function::PrivateLinkage, id + "_clo", TheModule.get());
+    BasicBlock *PrevBB = Builder.GetInsertBlock();
+    BasicBlock *BodyBB = BasicBlock::Create(TheContext, "body", code);
+    Builder.SetInsertPoint(BodyBB);
+    Function::arg_iterator arg = code->arg_begin();
+    Value *ptr = Builder.CreateBitCast(arg++, PointerType::get(env_type, 0));
+    std::vector<Value *> arg_vec;
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      // The environment keeps its references for the next call
+      Value *v = Builder.CreateLoad(Builder.CreateStructGEP(env_type, ptr, i));
+      if (owned(fe->captures[i]))
+      {
+        dup(v);
+      }
+      arg_vec.push_back(v);
+    }
+    for (; arg != code->arg_end(); arg++)
+    {
+      arg_vec.push_back(arg);
+    }
+    CallInst *result = Builder.CreateCall(func, arg_vec);
+    result->setCallingConv(func->getCallingConv());
+    result->setTailCall();
+    Builder.CreateRet(result);
+    Builder.SetInsertPoint(PrevBB);
+  }
+  Value *clo = UndefValue::get(StructType::get(TheContext, {code->getType(), env_ptr_type}));
+  clo = Builder.CreateInsertValue(clo, code, 0);
+  return Builder.CreateInsertValue(clo, env, 1);
+}
+
 Value *Id_Expr::compile() const
 {
-  Function *func = TheModule->getFunction(Id);
-  return Builder.CreateCall(func, {}, "calltmp");
+  return entry->value;
 }
 
 Value *call::compile() const
 {
-  std::vector<Value *> value_vec;
-  for (Expr *expr : *expr_vec)
+  ConstrEntry *ce = tt.lookupConstructor(id);
+  if (ce != nullptr && unboxed(ce->type))
   {
-    value_vec.push_back(expr->compile());
+    // Its value is its only field
+    return (*expr_vec)[0]->compile();
   }
+  std::vector<Value *> value_vec;
   Function *func = TheModule->getFunction(id);
   if (func == nullptr) // Argument
   {
-    GlobalVariable *var = TheModule->getGlobalVariable(id, true);
-    Value *fptr = Builder.CreateLoad(var);
+    Value *clo = Builder.CreateLoad(getVariable(id));
+    Value *fptr = Builder.CreateExtractValue(clo, 0);
+    value_vec.push_back(Builder.CreateExtractValue(clo, 1));
+    for (Value *v : compileArgs(*expr_vec))
+    {
+      value_vec.push_back(v);
+    }
     PointerType *fn_ptr_type = dyn_cast<PointerType>(fptr->getType());
     FunctionType *fn_type = dyn_cast<FunctionType>(fn_ptr_type->getElementType());
-    return Builder.CreateCall(fn_type, fptr, value_vec, "calltmp");
+    return keep(Builder.CreateCall(fn_type, fptr, value_vec, "calltmp"));
+  }
+  FunctionEntry *fe = ft.lookup(id);
+  if (fe != nullptr)
+  {
+    std::set<std::string> args;
+    for (size_t i = 0; RC && i < expr_vec->size(); i++)
+    {
+      (*expr_vec)[i]->uses(args);
+    }
+    for (const std::string &c : fe->captures)
+    {
+      Value *v = Builder.CreateLoad(getVariable(c));
+      if (owned(c) && (LiveAfter.count(c) > 0 || args.count(c) > 0))
+      {
+        dup(v);
+      }
+      value_vec.push_back(v);
+    }
+  }
+  for (Value *v : compileArgs(*expr_vec))
+  {
+    value_vec.push_back(v);
+  }
+  if (ce != nullptr && !RC && Interned.count(ce->type) == 0 && (temp || (!owner.empty() && !escapes(owner))))
+  {
+    // Built in the frame, which outlives every pointer to it
+    Value *alloc = allocateFrame(ce->structType);
+    Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(ce->structType, 0));
+    if (!tagged(ce->type))
+    {
+      Builder.CreateStore(tagOf(ce), Builder.CreateStructGEP(ce->structType, ptr, 0));
+    }
+    Value *v = tagPtr(alloc, ce);
+    for (size_t i = 0; i < value_vec.size(); i++)
+    {
+      Builder.CreateStore(value_vec[i], fieldPtr(ce, v, i));
+    }
+    return v;
   }
-  return Builder.CreateCall(func, value_vec, "calltmp");
+  if (ce != nullptr && RC)
+  {
+    value_vec.insert(value_vec.begin(), takeToken(cellSize(ce)));
+  }
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  if (tail)
+  {
+    releaseAllTokens();
+  }
+  if (tail && id == TailId) // Self tail call: rebind the parameters and loop
+  {
+    size_t skip = value_vec.size() - LoopParams.size();
+    for (size_t i = 0; i < LoopParams.size(); i++)
+    {
+      Builder.CreateStore(value_vec[skip + i], LoopParams[i]);
+    }
+    Builder.CreateBr(LoopBB);
+    Builder.SetInsertPoint(BasicBlock::Create(TheContext, "tailcont", TheFunction));
+    return UndefValue::get(func->getReturnType());
+  }
+  CallInst *result = Builder.CreateCall(func, value_vec, "calltmp");
+  result->setCallingConv(func->getCallingConv());
+  if (tail && func->getCallingConv() == CallingConv::Fast)
+  {
+    // Calls within a let rec group with the same prototype must be tail calls
+    bool sibling = fe->group != 0 && fe->group == ft.lookup(TailId)->group;
+    bool musttail = sibling && func->getFunctionType() == TheFunction->getFunctionType();
+    result->setTailCallKind(musttail ? CallInst::TCK_MustTail : CallInst::TCK_Tail);
+    Builder.CreateRet(result);
+    Builder.SetInsertPoint(BasicBlock::Create(TheContext, "tailcont", TheFunction));
+    return UndefValue::get(func->getReturnType());
+  }
+  return keep(result);
 }
 
 Value *Array::compile() const
 {
-  Value *ptr = Builder.CreateLoad(TheModule->getGlobalVariable(id, true));
+  int n = expr_vec->size();
+  Value *ptr = Builder.CreateLoad(getVariable(id));
   Value *ptr64 = Builder.CreateBitCast(ptr, PointerType::get(i64, 0));
   Value *offset = c64(0);
-  Value *coeff = c64(1);
-  int i = -expr_vec->size();
-  for (auto e = expr_vec->rbegin(); e != expr_vec->rend(); e++)
+  for (int k = n - 1; k >= 0; k--)
+  {
+    std::set<std::string> later;
+    for (int j = k - 1; RC && j >= 0; j--)
+    {
+      (*expr_vec)[j]->uses(later);
+    }
+    Value *v = compileLive((*expr_vec)[k], later);
+    if (BoundsCheck && !safe[k])
+    {
+      // A negative index compares as a large unsigned one
+      Value *dim = loadHeader(ptr64, -(k + 1), "dim");
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *ErrorBB = BasicBlock::Create(TheContext, "outofbounds", TheFunction);
+      BasicBlock *InBB = BasicBlock::Create(TheContext, "inbounds", TheFunction);
+      Value *inside = Builder.CreateICmpULT(v, dim, "inside");
+      Builder.CreateCondBr(inside, InBB, ErrorBB, MDBuilder(TheContext).createBranchWeights(1 << 20, 1));
+      Builder.SetInsertPoint(ErrorBB);
+      Builder.CreateCall(TheModule->getFunction("array_bounds_error"));
+      Builder.CreateUnreachable();
+      Builder.SetInsertPoint(InBB);
+    }
+    if (k < n - 1)
+    {
+      v = Builder.CreateNSWMul(v, loadHeader(ptr64, -(n + k + 1), "stride"));
+    }
+    offset = Builder.CreateNSWAdd(offset, v);
+  }
+  return Builder.CreateInBoundsGEP(ptr, {offset}, id + "_ptr");
+}
+
+Value *Tuple::compile() const
+{
+  Value *v = UndefValue::get(typ->compile());
+  std::vector<Value *> value_vec = compileArgs(*expr_vec);
+  for (size_t i = 0; i < value_vec.size(); i++)
   {
-    Value *v = (*e)->compile();
-    offset = Builder.CreateAdd(offset, Builder.CreateMul(v, coeff));
-    Value *dim = Builder.CreateLoad(Builder.CreateGEP(ptr64, {c64(i++)}));
-    coeff = Builder.CreateMul(coeff, dim);
+    v = Builder.CreateInsertValue(v, value_vec[i], i);
   }
-  return Builder.CreateGEP(ptr, {offset}, id + "_ptr");
+  return v;
 }
 
 Value *Dim::compile() const
 {
-  Value *ptr = Builder.CreateLoad(TheModule->getGlobalVariable(id, true));
+  Value *ptr = Builder.CreateLoad(getVariable(id));
   Value *ptr64 = Builder.CreateBitCast(ptr, PointerType::get(i64, 0));
-  return Builder.CreateLoad(Builder.CreateGEP(ptr64, {c64(-ind)}, "dimtmp"));
+  return loadHeader(ptr64, -ind, "dimtmp");
 }
 
 Value *New::compile() const
 {
   llvm::Type *t = ty->compile();
-  DataLayout dataLayout("");
-  Value *size = c64(dataLayout.getTypeSizeInBits(t) / 8);
-  Value *alloc = Builder.CreateCall(TheModule->getFunction("malloc"), {size});
+  Value *alloc = temp || (!owner.empty() && !escapes(owner)) ? allocateFrame(t) : allocate(t);
   Value *ptr = Builder.CreateBitCast(alloc, PointerType::get(t, 0));
-  return ptr;
+  if (RC && isADT(ty))
+  {
+    Builder.CreateStore(Constant::getNullValue(t), ptr);
+  }
+  return keep(ptr);
 }
 
 Value *LetIn::compile() const
 {
+  std::set<std::string> prev = LiveAfter;
+  if (RC)
+  {
+    expr->uses(LiveAfter);
+  }
   letdef->compile();
+  LiveAfter = prev;
   return expr->compile();
 }
 
 Value *If::compile() const
 {
-  Value *cond = expr1->compile();
+  std::set<std::string> then_uses = usesOf(expr2), else_uses = usesOf(expr3);
+  std::set<std::string> both = then_uses;
+  both.insert(else_uses.begin(), else_uses.end());
+  Value *cond = compileLive(expr1, both);
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
   BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
   BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else", TheFunction);
   BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endif", TheFunction);
   Builder.CreateCondBr(cond, ThenBB, ElseBB);
   Builder.SetInsertPoint(ThenBB);
+  // Each branch drops what only the other one reads
+  size_t mark = ReuseTokens.size();
+  dropVars(else_uses, then_uses);
   Value *v2 = expr2->compile();
+  releaseTokens(mark);
   ThenBB = Builder.GetInsertBlock();
   Builder.CreateBr(AfterBB);
   Builder.SetInsertPoint(ElseBB);
+  dropVars(then_uses, else_uses);
   Value *v3 = cvoid();
   if (expr3 != nullptr)
   {
     v3 = expr3->compile();
   }
+  releaseTokens(mark);
   ElseBB = Builder.GetInsertBlock();
   Builder.CreateBr(AfterBB);
   Builder.SetInsertPoint(AfterBB);
@@ -876,81 +1695,174 @@ Value *While::compile() const
   BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endwhile", TheFunction);
   Builder.CreateBr(LoopBB);
   Builder.SetInsertPoint(LoopBB);
-  Value *loop_cond = cond->compile();
+  // Whatever the loop reads stays alive until it ends
+  std::set<std::string> loop = usesOf(this);
+  Value *loop_cond = compileLive(cond, loop);
   Builder.CreateCondBr(loop_cond, BodyBB, AfterBB);
   Builder.SetInsertPoint(BodyBB);
-  stmt->compile();
+  compileLive(stmt, loop);
   Builder.CreateBr(LoopBB);
   Builder.SetInsertPoint(AfterBB);
+  dropVars(loop);
   return cvoid();
 }
 
 Value *For::compile() const
 {
-  GlobalVariable *var = new GlobalVariable(*TheModule, i64, false, GlobalValue::PrivateLinkage, ConstantAggregateZero::get(i64), id);
-  Builder.CreateStore(start->compile(), var);
-  Value *v = end->compile();
+  std::set<std::string> body = usesOf(stmt);
+  std::set<std::string> later = usesOf(end);
+  later.insert(body.begin(), body.end());
+  Value *first = compileLive(start, later);
+  Value *last = compileLive(end, body);
+  Value *var = createVariable(id, i64);
   BasicBlock *PrevBB = Builder.GetInsertBlock();
   Function *TheFunction = PrevBB->getParent();
-  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
   BasicBlock *BodyBB = BasicBlock::Create(TheContext, "body", TheFunction);
   BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endfor", TheFunction);
-  Builder.CreateBr(LoopBB);
-  Builder.SetInsertPoint(LoopBB);
-  Value *iter = Builder.CreateLoad(var, "iter");
-  Value *loop_cond;
+  // Enter once if the range is not empty, then run last - first + 1 times
+  Value *enter;
   if (down)
   {
-    loop_cond = Builder.CreateICmpSGE(iter, v, "loop_cond");
+    enter = Builder.CreateICmpSGE(first, last, "enter");
   }
   else
   {
-    loop_cond = Builder.CreateICmpSLE(iter, v, "loop_cond");
+    enter = Builder.CreateICmpSLE(first, last, "enter");
   }
-  Builder.CreateCondBr(loop_cond, BodyBB, AfterBB);
+  Builder.CreateCondBr(enter, BodyBB, AfterBB);
   Builder.SetInsertPoint(BodyBB);
-  stmt->compile();
+  PHINode *iter = Builder.CreatePHI(i64, 2, "iter");
+  iter->addIncoming(first, PrevBB);
+  Builder.CreateStore(iter, var);
+  compileLive(stmt, body);
+  // Leave after the last value, so the next one never overflows when used
+  Value *loop_cond = Builder.CreateICmpNE(iter, last, "loop_cond");
   Value *new_iter;
   if (down)
   {
-    new_iter = Builder.CreateSub(iter, c64(1));
+    new_iter = Builder.CreateNSWSub(iter, c64(1), "next");
   }
   else
   {
-    new_iter = Builder.CreateAdd(iter, c64(1));
+    new_iter = Builder.CreateNSWAdd(iter, c64(1), "next");
   }
-  Builder.CreateStore(new_iter, var);
-  Builder.CreateBr(LoopBB);
+  iter->addIncoming(new_iter, Builder.GetInsertBlock());
+  Builder.CreateCondBr(loop_cond, BodyBB, AfterBB);
   Builder.SetInsertPoint(AfterBB);
+  dropVars(body);
   return cvoid();
 }
 
 Value *Match::compile() const
 {
-  Value *v = expr->compile();
-  std::vector<Value *> value_vec;
-  std::vector<BasicBlock *> block_vec;
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
-  BasicBlock *ThenBB = nullptr;
-  BasicBlock *ElseBB = nullptr;
-  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endif", TheFunction);
+  // With -frc, a local being matched lends its reference to the clauses
+  std::set<std::string> all;
+  for (size_t i = 0; RC && i < clause_vec->size(); i++)
+  {
+    (*clause_vec)[i]->uses(all);
+  }
+  std::string x;
+  bool counted = RC && TheFunction != TheModule->getFunction("main");
+  Value *v = counted && expr->get_var(x) && owned(x) ? Builder.CreateLoad(getVariable(x)) : compileLive(expr, all);
+  BasicBlock *FailBB = BasicBlock::Create(TheContext, "nomatch", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endmatch", TheFunction);
+  std::vector<BasicBlock *> block_vec;
+  bool switchable = true;
   for (Clause *cl : *clause_vec)
   {
-    ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-    ElseBB = BasicBlock::Create(TheContext, "else", TheFunction);
-    Value *cond = cl->pat->compile(v);
-    Builder.CreateCondBr(cond, ThenBB, ElseBB);
-    Builder.SetInsertPoint(ThenBB);
-    value_vec.push_back(cl->expr->compile());
-    ThenBB = Builder.GetInsertBlock();
-    block_vec.push_back(ThenBB);
+    block_vec.push_back(BasicBlock::Create(TheContext, "clause", TheFunction));
+    switchable = switchable && (cl->pat->is_wildcard() || cl->pat->get_case() != nullptr);
+  }
+  if (switchable)
+  {
+    // Dispatch once on the tag or the literal, then try the clauses of each
+    // case in order, testing only their fields
+    std::vector<ConstantInt *> cases;
+    for (Clause *cl : *clause_vec)
+    {
+      ConstantInt *c = cl->pat->get_case();
+      if (c != nullptr && std::find(cases.begin(), cases.end(), c) == cases.end())
+      {
+        cases.push_back(c);
+      }
+    }
+    Value *key = v;
+    if (v->getType()->isPointerTy())
+    {
+      key = cases.empty() ? c64(0) : loadTag(v, expr->typ->get_id());
+    }
+    BasicBlock *DefaultBB = BasicBlock::Create(TheContext, "default", TheFunction);
+    SwitchInst *sw = Builder.CreateSwitch(key, DefaultBB, cases.size());
+    cases.push_back(nullptr);
+    for (ConstantInt *c : cases)
+    {
+      BasicBlock *CaseBB = DefaultBB;
+      if (c != nullptr)
+      {
+        CaseBB = BasicBlock::Create(TheContext, "case", TheFunction);
+        sw->addCase(c, CaseBB);
+      }
+      Builder.SetInsertPoint(CaseBB);
+      bool matched = false;
+      for (size_t i = 0; i < clause_vec->size() && !matched; i++)
+      {
+        Pattern *pat = (*clause_vec)[i]->pat;
+        if (pat->is_wildcard())
+        {
+          pat->test(v, FailBB);
+          Builder.CreateBr(block_vec[i]);
+          matched = true;
+        }
+        else if (c != nullptr && pat->get_case() == c)
+        {
+          BasicBlock *NextBB = BasicBlock::Create(TheContext, "next", TheFunction);
+          pat->test_fields(v, NextBB);
+          Builder.CreateBr(block_vec[i]);
+          Builder.SetInsertPoint(NextBB);
+        }
+      }
+      if (!matched)
+      {
+        Builder.CreateBr(FailBB);
+      }
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < clause_vec->size(); i++)
+    {
+      BasicBlock *NextBB = BasicBlock::Create(TheContext, "next", TheFunction);
+      (*clause_vec)[i]->pat->test(v, NextBB);
+      Builder.CreateBr(block_vec[i]);
+      Builder.SetInsertPoint(NextBB);
+    }
+    Builder.CreateBr(FailBB);
+  }
+  std::vector<Value *> value_vec;
+  for (size_t i = 0; i < clause_vec->size(); i++)
+  {
+    Builder.SetInsertPoint(block_vec[i]);
+    size_t mark = ReuseTokens.size();
+    std::map<std::string, ConstrEntry *> shapes = KnownShape;
+    if (counted)
+    {
+      enter_clause(i, v, all);
+    }
+    value_vec.push_back((*clause_vec)[i]->expr->compile());
+    releaseTokens(mark);
+    KnownShape = shapes;
+    block_vec[i] = Builder.GetInsertBlock();
     Builder.CreateBr(AfterBB);
-    Builder.SetInsertPoint(ElseBB);
   }
-  std::string msg = "Runtime Error: No matching pattern found\n";
-  Builder.CreateCall(TheModule->getFunction("print_string_4"), {Builder.CreateGlobalStringPtr(msg)});
-  Builder.CreateCall(TheModule->getFunction("exit"), {c64(1)});
-  Builder.CreateBr(ElseBB);
+  Builder.SetInsertPoint(FailBB);
+  if (!exhaustive)
+  {
+    std::string msg = "Runtime Error: No matching pattern found\n";
+    Builder.CreateCall(TheModule->getFunction("print_string_4"), {Builder.CreateGlobalStringPtr(msg)});
+    Builder.CreateCall(TheModule->getFunction("exit"), {c64(1)});
+  }
+  Builder.CreateUnreachable();
   Builder.SetInsertPoint(AfterBB);
   PHINode *phi = Builder.CreatePHI(typ->compile(), value_vec.size(), "phi");
   for (size_t i = 0; i < value_vec.size(); i++)
@@ -960,91 +1872,118 @@ Value *Match::compile() const
   return phi;
 }
 
-Value *Pattern_Int_Expr::compile(Value *v) const
+void Pattern_Int_Expr::test(Value *v, BasicBlock *FailBB) const
 {
-  return Builder.CreateICmpEQ(v, c64(num), "pat_cond");
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(v, c64(num), "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
 }
 
-Value *Pattern_Float_Expr::compile(Value *v) const
+ConstantInt *Pattern_Int_Expr::get_case() const
 {
-  return Builder.CreateFCmpOEQ(v, cfloat(num), "pat_cond");
+  return c64(num);
 }
 
-Value *Pattern_Char_Expr::compile(Value *v) const
+void Pattern_Float_Expr::test(Value *v, BasicBlock *FailBB) const
 {
-  return Builder.CreateICmpEQ(v, c8(ch), "pat_cond");
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  Builder.CreateCondBr(Builder.CreateFCmpOEQ(v, cfloat(num), "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
 }
 
-Value *Pattern_Bool_Expr::compile(Value *v) const
+void Pattern_Char_Expr::test(Value *v, BasicBlock *FailBB) const
 {
-  return Builder.CreateICmpEQ(v, c1(boolean), "pat_cond");
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(v, c8(ch), "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
 }
 
-Value *Pattern_id::compile(Value *v) const
+ConstantInt *Pattern_Char_Expr::get_case() const
 {
-  llvm::Type *t = v->getType();
-  GlobalVariable *var = new GlobalVariable(*TheModule, t, false, GlobalValue::PrivateLinkage, ConstantAggregateZero::get(t), id);
-  Builder.CreateStore(v, var);
-  return c1(true);
+  return c8(ch);
+}
+
+void Pattern_Bool_Expr::test(Value *v, BasicBlock *FailBB) const
+{
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(v, c1(boolean), "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
+}
+
+ConstantInt *Pattern_Bool_Expr::get_case() const
+{
+  return c1(boolean);
 }
 
-Value *Pattern_Id::compile(Value *v) const
+void Pattern_id::test(Value *v, BasicBlock *FailBB) const
 {
-  std::string str = "";
-  for (auto it = Id.rbegin(); it != Id.rend(); ++it)
+  // The same binding may be reached from several cases
+  Value *var = getVariable(id);
+  if (var == nullptr)
   {
-    if (*it == '_')
-    {
-      break;
-    }
-    str = *it + str;
+    var = createVariable(id, v->getType());
   }
-  int num = stoi(str);
-  return Builder.CreateICmpEQ(Builder.CreateLoad(v), c64(num), "pat_cond");
+  Builder.CreateStore(v, var);
 }
 
-Value *Pattern_Call::compile(Value *v) const
+void Pattern_Id::test(Value *v, BasicBlock *FailBB) const
 {
-  std::string str = "";
-  for (auto it = Id.rbegin(); it != Id.rend(); ++it)
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  // Its only instance is the shared constant
+  Builder.CreateCondBr(Builder.CreateICmpEQ(v, entry->value, "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
+}
+
+ConstantInt *Pattern_Id::get_case() const
+{
+  return tagOf(entry);
+}
+
+void Pattern_Call::test(Value *v, BasicBlock *FailBB) const
+{
+  if (unboxed(entry->type))
   {
-    if (*it == '_')
-    {
-      break;
-    }
-    str = *it + str;
+    test_fields(v, FailBB);
+    return;
   }
-  int num = stoi(str);
-  Value *cond = Builder.CreateICmpEQ(Builder.CreateLoad(v), c64(num), "pat_cond");
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
-  BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else", TheFunction);
-  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "endif", TheFunction);
-  Builder.CreateCondBr(cond, ThenBB, ElseBB);
-  Builder.SetInsertPoint(ThenBB);
-  StructType *t = nullptr;
-  for (auto &structType : TheModule->getIdentifiedStructTypes())
+  BasicBlock *OkBB = BasicBlock::Create(TheContext, "pat_ok", TheFunction);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(loadTag(v, entry->type), get_case(), "pat_cond"), OkBB, FailBB);
+  Builder.SetInsertPoint(OkBB);
+  test_fields(v, FailBB);
+}
+
+void Pattern_Call::test_fields(Value *v, BasicBlock *FailBB) const
+{
+  if (unboxed(entry->type))
   {
-    if (structType->getName() == Id)
-    {
-      t = structType;
-      break;
-    }
+    (*pattern_vec)[0]->test(v, FailBB);
+    return;
   }
-  Value *alloc = Builder.CreateBitCast(v, PointerType::get(t, 0));
-  int i = 1;
-  for (Pattern *pat : *pattern_vec)
+  for (size_t i = 0; i < pattern_vec->size(); i++)
   {
-    Value *MemberPointer = Builder.CreateStructGEP(t, alloc, i++);
-    cond = Builder.CreateAnd(cond, pat->compile(Builder.CreateLoad(MemberPointer)));
+    (*pattern_vec)[i]->test(Builder.CreateLoad(fieldPtr(entry, v, i)), FailBB);
+  }
+}
+
+ConstantInt *Pattern_Call::get_case() const
+{
+  if (unboxed(entry->type))
+  {
+    return nullptr;
+  }
+  return tagOf(entry);
+}
+
+void Pattern_Tuple::test(Value *v, BasicBlock *FailBB) const
+{
+  for (size_t i = 0; i < pattern_vec->size(); i++)
+  {
+    (*pattern_vec)[i]->test(Builder.CreateExtractValue(v, i), FailBB);
   }
-  ThenBB = Builder.GetInsertBlock();
-  Builder.CreateBr(AfterBB);
-  Builder.SetInsertPoint(ElseBB);
-  Builder.CreateBr(AfterBB);
-  Builder.SetInsertPoint(AfterBB);
-  PHINode *phi = Builder.CreatePHI(i1, 2, "phi");
-  phi->addIncoming(cond, ThenBB);
-  phi->addIncoming(c1(false), ElseBB);
-  return phi;
 }
@@ -0,0 +1,289 @@
+#include "ast.hpp"
+
+// Escape analysis: a ref, an array or a constructor value is made in the
+// frame of the function creating it when no pointer to it can outlive that
+// frame. A pointer escapes when it is stored, returned, captured by a
+// closure or passed to a tail call; dereferencing, assigning, indexing,
+// comparing and matching it does not. Passing it to a function escapes it
+// only if the parameter escapes in turn.
+
+std::set<std::string> AST::Escaping;
+std::multimap<std::string, std::string> AST::FlowsTo;
+std::string AST::EscapeFn;
+
+// Arrays larger than this stay on the heap
+static const int MaxFrameArray = 4096;
+
+bool AST::escapes(const std::string &id) const
+{
+  return Escaping.count(id) > 0;
+}
+
+Value *AST::allocateFrame(llvm::Type *t, const std::vector<int64_t> &header) const
+{
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock &EntryBB = TheFunction->getEntryBlock();
+  IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+  AllocaInst *slot = TmpB.CreateAlloca(t, nullptr, "frame");
+  // Aligned as the heap's cells, whose pointers may carry a tag
+  slot->setAlignment(Align(PointerTags));
+  // Words that never change are written as soon as the slot exists, so no
+  // load of them, however far it is hoisted, can see them unwritten
+  Value *words = TmpB.CreateBitCast(slot, PointerType::get(i64, 0));
+  for (size_t i = 0; i < header.size(); i++)
+  {
+    TmpB.CreateStore(c64(header[i]), TmpB.CreateConstInBoundsGEP1_64(i64, words, i));
+  }
+  // The collector still has to see what it points to
+  addRoot(slot, t);
+  return Builder.CreateBitCast(slot, PointerType::get(i64, 0));
+}
+
+void Program::escape()
+{
+  for (Stmt *stmt : *statements)
+  {
+    stmt->escape();
+  }
+  // Whatever flows into an escaping variable escapes too
+  std::vector<std::string> work(Escaping.begin(), Escaping.end());
+  while (!work.empty())
+  {
+    std::string id = work.back();
+    work.pop_back();
+    auto range = FlowsTo.equal_range(id);
+    for (auto it = range.first; it != range.second; it++)
+    {
+      if (Escaping.insert(it->second).second)
+      {
+        work.push_back(it->second);
+      }
+    }
+  }
+}
+
+void LetDef::escape()
+{
+  for (Def *def : *def_vec)
+  {
+    def->escape();
+  }
+}
+
+void NormalDef::escape()
+{
+  if (par_vec->size() == 0) // Constant
+  {
+    expr->flow(id);
+    return;
+  }
+  std::string PrevFn = EscapeFn;
+  EscapeFn = id;
+  expr->escape();
+  EscapeFn = PrevFn;
+}
+
+void MutableDef::escape()
+{
+  if (expr_vec != nullptr)
+  {
+    for (Expr *e : *expr_vec)
+    {
+      e->escape();
+    }
+  }
+}
+
+void LetIn::escape()
+{
+  letdef->escape();
+  expr->escape();
+}
+
+void UnOp::escape()
+{
+  if (op == unop_exclamation)
+  {
+    expr->borrow();
+  }
+  else
+  {
+    expr->escape();
+  }
+}
+
+void BinOp::escape()
+{
+  switch (op)
+  {
+  case binop_assign:
+    left->borrow();
+    right->escape();
+    return;
+  case binop_struct_eq:
+  case binop_struct_ne:
+  case binop_phys_eq:
+  case binop_phys_ne:
+  case binop_semicolon:
+    left->borrow();
+    op == binop_semicolon ? right->escape() : right->borrow();
+    return;
+  default:
+    left->escape();
+    right->escape();
+    return;
+  }
+}
+
+void id_Expr::escape()
+{
+  Escaping.insert(id);
+  // A closure keeps the captured locals
+  FunctionEntry *fe = ft.lookup(id);
+  if (fe != nullptr)
+  {
+    Escaping.insert(fe->captures.begin(), fe->captures.end());
+  }
+}
+
+void id_Expr::flow(const std::string &to)
+{
+  if (ft.lookup(id) != nullptr)
+  {
+    escape();
+    return;
+  }
+  FlowsTo.insert({to, id});
+}
+
+void call::escape()
+{
+  FunctionEntry *fe = ft.lookup(id);
+  bool self = tail && id == EscapeFn;
+  if (fe != nullptr && tail && !self)
+  {
+    // The frame is gone by the time the callee runs
+    Escaping.insert(fe->captures.begin(), fe->captures.end());
+  }
+  for (size_t i = 0; i < expr_vec->size(); i++)
+  {
+    Expr *e = (*expr_vec)[i];
+    std::string x;
+    if (id == str_incr || id == str_decr || id == str_print_string || id == str_read_string ||
+        id == str_strlen || id == str_strcmp || id == str_strcpy || id == str_strcat)
+    {
+      // The library only reads and writes through its arguments
+      e->borrow();
+    }
+    else if (fe != nullptr && i >= fe->params.size())
+    {
+      e->escape();
+    }
+    else if (fe != nullptr && !tail)
+    {
+      e->flow(fe->params[i]);
+    }
+    else if (self && e->get_var(x) && std::find(fe->params.begin(), fe->params.end(), x) != fe->params.end())
+    {
+      // A self tail call only rebinds the parameters, but the frame's own
+      // values would be overwritten by the next iteration
+      e->flow(fe->params[i]);
+    }
+    else
+    {
+      e->escape();
+    }
+  }
+}
+
+void call::borrow()
+{
+  escape();
+  temp = true;
+}
+
+void call::flow(const std::string &to)
+{
+  escape();
+  owner = to;
+}
+
+void New::borrow()
+{
+  temp = true;
+}
+
+void New::flow(const std::string &to)
+{
+  owner = to;
+}
+
+void Array::escape()
+{
+  Escaping.insert(id);
+  borrow();
+}
+
+void Array::borrow()
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->escape();
+  }
+}
+
+// Matching a tuple binds its components, so they escape with it
+void Tuple::escape()
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->escape();
+  }
+}
+
+void If::escape()
+{
+  expr1->escape();
+  expr2->escape();
+  if (expr3 != nullptr)
+  {
+    expr3->escape();
+  }
+}
+
+void While::escape()
+{
+  cond->escape();
+  stmt->escape();
+}
+
+void For::escape()
+{
+  start->escape();
+  end->escape();
+  stmt->escape();
+}
+
+void Match::escape()
+{
+  // A variable pattern at the top binds the value itself
+  bool bound = false;
+  for (Clause *cl : *clause_vec)
+  {
+    bound = bound || cl->pat->is_wildcard();
+    cl->escape();
+  }
+  if (bound)
+  {
+    expr->escape();
+  }
+  else
+  {
+    expr->borrow();
+  }
+}
+
+void Clause::escape()
+{
+  expr->escape();
+}
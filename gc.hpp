@@ -0,0 +1,176 @@
+#include "ast.hpp"
+
+// Garbage collection support for -fgc: heap objects carry a layout saying
+// where their pointers are (see lib/gc.c), and every function links a
+// shadow stack frame holding its variables and the temporaries that may
+// point to the heap while it allocates.
+
+bool AST::GC = false;
+std::map<Function *, std::vector<AllocaInst *>> AST::GCRoots;
+std::vector<GlobalVariable *> AST::GCGlobals;
+
+void Program::gc()
+{
+  GC = true;
+}
+
+void AST::pointerOffsets(llvm::Type *t, uint64_t base, std::vector<uint64_t> &offs) const
+{
+  if (t->isPointerTy())
+  {
+    offs.push_back(base);
+  }
+  else if (StructType *st = dyn_cast<StructType>(t))
+  {
+    const StructLayout *sl = TheModule->getDataLayout().getStructLayout(st);
+    for (unsigned i = 0; i < st->getNumElements(); i++)
+    {
+      pointerOffsets(st->getElementType(i), base + sl->getElementOffset(i), offs);
+    }
+  }
+  else if (ArrayType *at = dyn_cast<ArrayType>(t))
+  {
+    uint64_t size = TheModule->getDataLayout().getTypeAllocSize(at->getElementType());
+    for (uint64_t i = 0; i < at->getNumElements(); i++)
+    {
+      pointerOffsets(at->getElementType(), base + i * size, offs);
+    }
+  }
+}
+
+Constant *AST::layout(uint64_t size, int dims, const std::vector<uint64_t> &offs) const
+{
+  std::vector<Constant *> words = {c64(dims), c64(size), c64(offs.size())};
+  for (uint64_t off : offs)
+  {
+    words.push_back(c64(off));
+  }
+  ArrayType *t = ArrayType::get(i64, words.size());
+  GlobalVariable *gv = new GlobalVariable(*TheModule, t, true, GlobalValue::PrivateLinkage,
+                                          ConstantArray::get(t, words), "gc_layout");
+  gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return ConstantExpr::getInBoundsGetElementPtr(t, gv, ArrayRef<Constant *>{c64(0), c64(0)});
+}
+
+Constant *AST::layoutOf(llvm::Type *t, int dims) const
+{
+  static std::map<std::pair<llvm::Type *, int>, Constant *> layouts;
+  Constant *&l = layouts[{t, dims}];
+  if (l == nullptr)
+  {
+    std::vector<uint64_t> offs;
+    pointerOffsets(t, 0, offs);
+    l = layout(TheModule->getDataLayout().getTypeAllocSize(t), dims, offs);
+  }
+  return l;
+}
+
+void AST::addRoot(Value *var, llvm::Type *t) const
+{
+  std::vector<uint64_t> offs;
+  pointerOffsets(t, 0, offs);
+  if (!GC || offs.empty())
+  {
+    return;
+  }
+  if (AllocaInst *slot = dyn_cast<AllocaInst>(var))
+  {
+    GCRoots[slot->getFunction()].push_back(slot);
+  }
+  else
+  {
+    GCGlobals.push_back(cast<GlobalVariable>(var));
+  }
+}
+
+Value *AST::keep(Value *v) const
+{
+  std::vector<uint64_t> offs;
+  pointerOffsets(v->getType(), 0, offs);
+  if (!GC || offs.empty())
+  {
+    return v;
+  }
+  // A slot of its own, as later allocations may run the collector
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock &EntryBB = TheFunction->getEntryBlock();
+  IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+  AllocaInst *slot = TmpB.CreateAlloca(v->getType(), nullptr, "gc_tmp");
+  GCRoots[TheFunction].push_back(slot);
+  Builder.CreateStore(v, slot);
+  return v;
+}
+
+void Program::llvm_gc_frames()
+{
+  GlobalVariable *head = TheModule->getNamedGlobal("llama_gc_roots");
+  PointerType *i8p = PointerType::get(i8, 0);
+  // Top level roots are registered before main runs
+  Function *main = TheModule->getFunction("main");
+  IRBuilder<> MainB(&main->getEntryBlock(), main->getEntryBlock().begin());
+  for (GlobalVariable *gv : GCGlobals)
+  {
+    MainB.CreateCall(TheModule->getFunction("llama_gc_add_root"),
+                     {MainB.CreateBitCast(gv, i8p), layoutOf(gv->getValueType(), 0)});
+  }
+  for (Function &F : *TheModule)
+  {
+    auto entry = GCRoots.find(&F);
+    if (entry == GCRoots.end())
+    {
+      continue;
+    }
+    Function *func = &F;
+    std::vector<AllocaInst *> &roots = entry->second;
+    // The frame is {next, layout, roots...}, linked in on entry
+    std::vector<llvm::Type *> members = {i8p, PointerType::get(i64, 0)};
+    for (AllocaInst *root : roots)
+    {
+      members.push_back(root->getAllocatedType());
+    }
+    StructType *frame_type = StructType::get(TheContext, members);
+    const StructLayout *sl = TheModule->getDataLayout().getStructLayout(frame_type);
+    std::vector<uint64_t> offs;
+    for (size_t i = 0; i < roots.size(); i++)
+    {
+      pointerOffsets(members[i + 2], sl->getElementOffset(i + 2), offs);
+    }
+    BasicBlock &EntryBB = func->getEntryBlock();
+    IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+    Value *frame = TmpB.CreateAlloca(frame_type, nullptr, "gc_frame");
+    Value *next = TmpB.CreateStructGEP(frame_type, frame, 0);
+    for (size_t i = 0; i < roots.size(); i++)
+    {
+      Value *slot = TmpB.CreateStructGEP(frame_type, frame, i + 2, roots[i]->getName());
+      TmpB.CreateStore(Constant::getNullValue(members[i + 2]), slot);
+      roots[i]->replaceAllUsesWith(slot);
+    }
+    TmpB.CreateStore(layout(sl->getSizeInBytes(), 0, offs), TmpB.CreateStructGEP(frame_type, frame, 1));
+    TmpB.CreateStore(TmpB.CreateLoad(head), next);
+    TmpB.CreateStore(TmpB.CreateBitCast(frame, i8p), head);
+    for (AllocaInst *root : roots)
+    {
+      root->eraseFromParent();
+    }
+    // Unlinked on every return, before a tail call since it reuses the frame
+    for (BasicBlock &BB : *func)
+    {
+      for (auto it = BB.begin(); it != BB.end();)
+      {
+        Instruction *inst = &*it++;
+        CallInst *call = dyn_cast<CallInst>(inst);
+        if (call != nullptr && call->isTailCall() && !isa<ReturnInst>(call->getNextNode()))
+        {
+          call->setTailCall(false);
+        }
+        if (ReturnInst *ret = dyn_cast<ReturnInst>(inst))
+        {
+          Instruction *prev = ret->getPrevNode();
+          CallInst *tail = dyn_cast_or_null<CallInst>(prev);
+          IRBuilder<> RetB(tail != nullptr && tail->isTailCall() ? prev : ret);
+          RetB.CreateStore(RetB.CreateLoad(next), head);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,112 @@
+#include "ast.hpp"
+
+// Hash-consing for -fhash-cons. Values of a data type that can never change
+// (no refs, floats or functions in them, directly or through other types)
+// are interned: a constructor first looks its would-be cell up in a table
+// of the runtime and returns the equal cell it finds, so equal values share
+// one cell and = on them is a pointer compare. The table does not keep its
+// cells alive under -fgc (see lib/hashcons.c).
+
+bool AST::HashCons = false;
+std::set<std::string> AST::Interned;
+
+void Program::hash_cons()
+{
+  HashCons = true;
+}
+
+bool AST::immutable(::Type *t, std::set<std::string> &seen) const
+{
+  switch (t->get_type())
+  {
+  case type_ref:
+  case type_float:
+  case type_func:
+    return false;
+  case type_id:
+    if (!seen.insert(t->get_id()).second)
+    {
+      return true;
+    }
+    for (ConstrEntry *c : tt.getConstructors(t->get_id()))
+    {
+      for (::Type *field : c->fields)
+      {
+        if (!immutable(field, seen))
+        {
+          return false;
+        }
+      }
+    }
+    return true;
+  case type_tuple:
+    for (int i = 0; i < t->getDim(); i++)
+    {
+      if (!immutable(t->getChild(i), seen))
+      {
+        return false;
+      }
+    }
+    return true;
+  default:
+    return true;
+  }
+}
+
+bool AST::interned(::Type *t) const
+{
+  return t->get_type() == type_id && Interned.count(t->get_id()) > 0;
+}
+
+Value *AST::internCell(ConstrEntry *e, const std::vector<Value *> &fields) const
+{
+  StructType *t = e->structType;
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock &EntryBB = TheFunction->getEntryBlock();
+  IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+  // The candidate is built zeroed, so padding never tells equal cells apart
+  AllocaInst *cand = TmpB.CreateAlloca(t, nullptr, "cand");
+  Value *size = sizeOf(t);
+  Builder.CreateMemSet(cand, c8(0), size, cand->getAlign());
+  if (!tagged(e->type))
+  {
+    Builder.CreateStore(tagOf(e), Builder.CreateStructGEP(t, cand, 0));
+  }
+  for (size_t i = 0; i < fields.size(); i++)
+  {
+    Builder.CreateStore(fields[i], Builder.CreateStructGEP(t, cand, e->slots[i]));
+  }
+  // Cells of different constructors may hold the same bytes, so the table
+  // also keys them by a number for the constructor
+  static std::map<ConstrEntry *, uint64_t> kinds;
+  Value *kind = c64(kinds.emplace(e, kinds.size()).first->second);
+  Value *cand64 = Builder.CreateBitCast(cand, PointerType::get(i64, 0));
+  Value *found = Builder.CreateCall(TheModule->getFunction("llama_hc_find"), {cand64, size, kind}, "found");
+  BasicBlock *FoundBB = BasicBlock::Create(TheContext, "found", TheFunction);
+  BasicBlock *NewBB = BasicBlock::Create(TheContext, "new", TheFunction);
+  Builder.CreateCondBr(Builder.CreateIsNull(found), NewBB, FoundBB);
+  Builder.SetInsertPoint(NewBB);
+  Value *alloc = allocate(t);
+  Builder.CreateMemCpy(alloc, MaybeAlign(8), cand64, cand->getAlign(), size);
+  Builder.CreateCall(TheModule->getFunction("llama_hc_insert"), {alloc, size, kind});
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "interned", TheFunction);
+  Builder.CreateBr(AfterBB);
+  NewBB = Builder.GetInsertBlock();
+  Builder.SetInsertPoint(FoundBB);
+  Builder.CreateBr(AfterBB);
+  Builder.SetInsertPoint(AfterBB);
+  PHINode *phi = Builder.CreatePHI(PointerType::get(i64, 0), 2, "cell");
+  phi->addIncoming(found, FoundBB);
+  phi->addIncoming(alloc, NewBB);
+  return tagPtr(phi, e);
+}
+
+void Program::llvm_hash_cons_runtime()
+{
+  PointerType *i64p = PointerType::get(i64, 0);
+  FunctionType *find_type = FunctionType::get(i64p, {i64p, i64, i64}, false);
+  Function *find = Function::Create(find_type, Function::ExternalLinkage, "llama_hc_find", TheModule.get());
+  find->addFnAttr(Attribute::ReadOnly);
+  FunctionType *insert_type = FunctionType::get(voi, {i64p, i64, i64}, false);
+  Function::Create(insert_type, Function::ExternalLinkage, "llama_hc_insert", TheModule.get());
+}
@@ -0,0 +1,79 @@
+#include "ast.hpp"
+
+using namespace llvm;
+
+int Program::llvm_run(int opt_level, std::string CPU, std::string Features, std::string cache_dir)
+{
+  llvm_compile(opt_level, CPU, Features, true);
+  // Object code is cached by the hash of the unoptimized IR and the target options
+  std::string cache_file = "";
+  std::unique_ptr<MemoryBuffer> object;
+  if (cache_dir != "")
+  {
+    std::string ir;
+    raw_string_ostream ir_stream(ir);
+    TheModule->print(ir_stream, nullptr);
+    ir_stream << opt_level << CPU << Features;
+    MD5 hash;
+    hash.update(ir_stream.str());
+    MD5::MD5Result result;
+    hash.final(result);
+    SmallString<128> path(cache_dir);
+    sys::path::append(path, result.digest().str() + ".o");
+    cache_file = path.str().str();
+    ErrorOr<std::unique_ptr<MemoryBuffer>> cached = MemoryBuffer::getFile(cache_file);
+    if (cached)
+    {
+      object = std::move(*cached);
+    }
+  }
+  // Load the object with the runtime library and libc of this process
+  ExitOnError ExitOnErr("Failed to run the program: ");
+  std::unique_ptr<orc::LLJIT> J = ExitOnErr(orc::LLJITBuilder().create());
+  char prefix = TheModule->getDataLayout().getGlobalPrefix();
+  J->getMainJITDylib().addGenerator(ExitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+  bool loaded = false;
+  if (object != nullptr)
+  {
+    // A damaged cache entry is compiled again
+    Error error = J->addObjectFile(std::move(object));
+    loaded = !error;
+    consumeError(std::move(error));
+  }
+  if (!loaded)
+  {
+    llvm_optimize(opt_level);
+    SmallVector<char, 0> buffer;
+    raw_svector_ostream out(buffer);
+    llvm_emit(out, true);
+    if (cache_file != "" && !sys::fs::create_directories(cache_dir))
+    {
+      // Written aside and renamed into place, so no run sees half a file
+      SmallString<128> model(cache_dir);
+      sys::path::append(model, "%%%%%%%%%%%%.tmp");
+      SmallString<128> temp;
+      int fd;
+      if (!sys::fs::createUniqueFile(model, fd, temp))
+      {
+        raw_fd_ostream file(fd, true);
+        file << out.str();
+        file.close();
+        if (file.has_error())
+        {
+          file.clear_error();
+          sys::fs::remove(temp);
+        }
+        else if (sys::fs::rename(temp, cache_file))
+        {
+          sys::fs::remove(temp);
+        }
+      }
+    }
+    ExitOnErr(J->addObjectFile(std::make_unique<SmallVectorMemoryBuffer>(std::move(buffer))));
+  }
+  JITEvaluatedSymbol symbol = ExitOnErr(J->lookup("main"));
+  auto *entry = (int64_t(*)())symbol.getAddress();
+  int result = entry();
+  fflush(stdout);
+  return result;
+}
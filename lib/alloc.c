@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Small cells are carved out of large regions by bumping a pointer, and
+// freed cells are kept on a free list per 8-byte size class. The common
+// case of both is inlined by the compiler, which only calls in here when
+// the current region runs out.
+
+#define GRANULE 8
+#define MAX_SMALL 256
+#define REGION_SIZE (1 << 20)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+char *llama_heap_ptr;
+char *llama_heap_end;
+void *llama_free_list[MAX_SMALL / GRANULE + 1];
+
+void *llama_alloc_slow(int64_t size)
+{
+    size = MAX(size, GRANULE);
+    if (size > MAX_SMALL)
+    {
+        return malloc(size);
+    }
+    char *region = malloc(REGION_SIZE);
+    if (region == NULL)
+    {
+        fprintf(stderr, "Runtime error: out of memory\n");
+        exit(1);
+    }
+    llama_heap_ptr = region + size;
+    llama_heap_end = region + REGION_SIZE;
+    return region;
+}
+
+void llama_free(void *p, int64_t size)
+{
+    size = MAX(size, GRANULE);
+    if (size > MAX_SMALL)
+    {
+        free(p);
+        return;
+    }
+    void **cell = p;
+    *cell = llama_free_list[size / GRANULE];
+    llama_free_list[size / GRANULE] = cell;
+}
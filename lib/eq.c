@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Structural equality of values of data types. The compiler emits a step
+// per type that compares the tags and plain fields of two cells and pushes
+// the pairs of fields holding other cells here, so comparing deep values
+// does not grow the C stack, and the first mismatch ends the comparison.
+
+typedef struct eq_stack eq_stack;
+typedef bool (*eq_step)(int64_t *, int64_t *, eq_stack *);
+
+typedef struct eq_pair
+{
+    int64_t *l, *r;
+    eq_step step;
+} eq_pair;
+
+struct eq_stack
+{
+    eq_pair *pairs;
+    size_t top, max;
+};
+
+#define SMALL_STACK 64
+
+void llama_eq_push(eq_stack *s, int64_t *l, int64_t *r, eq_step step)
+{
+    if (s->top == s->max)
+    {
+        eq_pair *pairs = malloc(2 * s->max * sizeof(eq_pair));
+        if (pairs == NULL)
+        {
+            fprintf(stderr, "Runtime error: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < s->top; i++)
+        {
+            pairs[i] = s->pairs[i];
+        }
+        if (s->max > SMALL_STACK)
+        {
+            free(s->pairs);
+        }
+        s->pairs = pairs;
+        s->max *= 2;
+    }
+    s->pairs[s->top++] = (eq_pair){l, r, step};
+}
+
+bool llama_equal(int64_t *l, int64_t *r, eq_step step)
+{
+    eq_pair small[SMALL_STACK];
+    eq_stack s = {small, 0, SMALL_STACK};
+    bool equal = true;
+    llama_eq_push(&s, l, r, step);
+    while (equal && s.top > 0)
+    {
+        eq_pair p = s.pairs[--s.top];
+        equal = p.step(p.l, p.r, &s);
+    }
+    if (s.max > SMALL_STACK)
+    {
+        free(s.pairs);
+    }
+    return equal;
+}
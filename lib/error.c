@@ -0,0 +1,8 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+void array_bounds_error()
+{
+    fprintf(stderr, "Runtime error: array index out of bounds\n");
+    exit(1);
+}
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Mark-sweep collector used with -fgc. Every object starts with a header
+// word pointing to a layout emitted by the compiler, with the low bit as the
+// mark. A layout is {dims, size, count, offsets...}: the payload is one
+// record of size bytes (dims = 0) or an array with that many dimensions
+// whose elements are such records, and offsets locate its pointer fields.
+// Roots are the shadow stack frames linked from llama_gc_roots, laid out
+// as {next, layout, slots...}, and the globals registered by the program.
+// Pointers that do not land in an object of the heap are ignored, so
+// string literals and shared constants need no special casing.
+
+#define GRANULE 8
+#define MAX_SLOT (256 + GRANULE)
+#define CHUNK_SIZE (64 * 1024)
+#ifndef MIN_HEAP
+#define MIN_HEAP (4 * 1024 * 1024)
+#endif
+
+typedef struct frame
+{
+    struct frame *next;
+    const int64_t *layout;
+} frame;
+
+typedef struct chunk
+{
+    char *start, *end;
+    // Size of each object slot, or 0 for a single large object
+    size_t slot;
+} chunk;
+
+frame *llama_gc_roots;
+
+void llama_hc_prune();
+
+static void *free_list[MAX_SLOT / GRANULE + 1];
+static chunk *chunks;
+static size_t num_chunks, max_chunks;
+static void **globals;
+static size_t num_globals, max_globals;
+static void **mark_stack;
+static size_t mark_top, mark_max;
+
+static size_t heap_size, peak_heap, allocated, threshold = MIN_HEAP;
+static size_t collections, live;
+static double total_pause, max_pause;
+static int initialized;
+
+static void *grow(void *array, size_t *max, size_t elem)
+{
+    *max = *max ? 2 * *max : 64;
+    array = realloc(array, *max * elem);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Runtime error: out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+static void stats()
+{
+    fprintf(stderr, "GC: %zu collections, %.3f ms total pause, %.3f ms max pause\n",
+            collections, total_pause * 1e3, max_pause * 1e3);
+    fprintf(stderr, "GC: %zu KB heap, %zu KB peak, %zu KB live after last collection\n",
+            heap_size / 1024, peak_heap / 1024, live / 1024);
+}
+
+static void add_chunk(char *start, size_t size, size_t slot)
+{
+    if (num_chunks == max_chunks)
+    {
+        chunks = grow(chunks, &max_chunks, sizeof(chunk));
+    }
+    // Kept sorted by address for lookups
+    size_t i = num_chunks++;
+    while (i > 0 && chunks[i - 1].start > start)
+    {
+        chunks[i] = chunks[i - 1];
+        i--;
+    }
+    chunks[i] = (chunk){start, start + size, slot};
+    heap_size += size;
+    if (heap_size > peak_heap)
+    {
+        peak_heap = heap_size;
+    }
+}
+
+// The object containing p, if any
+static int64_t *find(char *p)
+{
+    size_t lo = 0, hi = num_chunks;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (p < chunks[mid].start)
+        {
+            hi = mid;
+        }
+        else if (p >= chunks[mid].end)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            chunk *c = &chunks[mid];
+            char *obj = c->slot ? c->start + (p - c->start) / c->slot * c->slot : c->start;
+            return *(int64_t *)obj ? (int64_t *)obj : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void mark(char *p)
+{
+    int64_t *obj = find(p);
+    if (obj == NULL || (*obj & 1))
+    {
+        return;
+    }
+    *obj |= 1;
+    if (mark_top == mark_max)
+    {
+        mark_stack = grow(mark_stack, &mark_max, sizeof(void *));
+    }
+    mark_stack[mark_top++] = obj;
+}
+
+static void scan(char *base, const int64_t *layout)
+{
+    for (int64_t i = 0; i < layout[2]; i++)
+    {
+        mark(*(char **)(base + layout[3 + i]));
+    }
+}
+
+static void scan_object(int64_t *obj)
+{
+    const int64_t *layout = (const int64_t *)(*obj & ~1);
+    int64_t dims = layout[0];
+    if (dims == 0)
+    {
+        scan((char *)(obj + 1), layout);
+        return;
+    }
+    // Elements follow the dimensions and strides
+    int64_t *elems = obj + 1 + 2 * dims - 1;
+    int64_t count = 1;
+    for (int64_t k = 1; k <= dims; k++)
+    {
+        count *= elems[-k];
+    }
+    if (layout[2] == 0)
+    {
+        return;
+    }
+    for (int64_t i = 0; i < count; i++)
+    {
+        scan((char *)elems + i * layout[1], layout);
+    }
+}
+
+static void sweep()
+{
+    memset(free_list, 0, sizeof(free_list));
+    live = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < num_chunks; i++)
+    {
+        chunk c = chunks[i];
+        if (c.slot == 0)
+        {
+            if (*(int64_t *)c.start & 1)
+            {
+                *(int64_t *)c.start &= ~1;
+                live += c.end - c.start;
+                chunks[j++] = c;
+            }
+            else
+            {
+                heap_size -= c.end - c.start;
+                free(c.start);
+            }
+            continue;
+        }
+        for (char *obj = c.start; obj + c.slot <= c.end; obj += c.slot)
+        {
+            int64_t *header = (int64_t *)obj;
+            if (*header & 1)
+            {
+                *header &= ~1;
+                live += c.slot;
+            }
+            else
+            {
+                *header = 0;
+                *(void **)(header + 1) = free_list[c.slot / GRANULE];
+                free_list[c.slot / GRANULE] = header;
+            }
+        }
+        chunks[j++] = c;
+    }
+    num_chunks = j;
+}
+
+static void collect()
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (frame *f = llama_gc_roots; f != NULL; f = f->next)
+    {
+        scan((char *)f, f->layout);
+    }
+    for (size_t i = 0; i < num_globals; i += 2)
+    {
+        scan(globals[i], globals[i + 1]);
+    }
+    while (mark_top > 0)
+    {
+        scan_object(mark_stack[--mark_top]);
+    }
+    // Interned cells only live as long as something else points to them
+    llama_hc_prune();
+    sweep();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double pause = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    total_pause += pause;
+    if (pause > max_pause)
+    {
+        max_pause = pause;
+    }
+    collections++;
+    allocated = 0;
+    threshold = live > MIN_HEAP ? live : MIN_HEAP;
+}
+
+static void init()
+{
+    initialized = 1;
+    if (getenv("LLAMA_GC_STATS") != NULL)
+    {
+        atexit(stats);
+    }
+}
+
+void llama_gc_add_root(void *addr, const int64_t *layout)
+{
+    if (num_globals + 2 > max_globals)
+    {
+        globals = grow(globals, &max_globals, sizeof(void *));
+    }
+    globals[num_globals++] = addr;
+    globals[num_globals++] = (void *)layout;
+}
+
+void *llama_gc_alloc(int64_t size, const int64_t *layout)
+{
+    if (!initialized)
+    {
+        init();
+    }
+    size_t slot = (size + GRANULE - 1) / GRANULE * GRANULE + GRANULE;
+    if (slot < 2 * GRANULE)
+    {
+        slot = 2 * GRANULE;
+    }
+    if (allocated >= threshold)
+    {
+        collect();
+    }
+    allocated += slot;
+    int64_t *obj;
+    if (slot > MAX_SLOT)
+    {
+        obj = malloc(slot);
+        if (obj == NULL)
+        {
+            fprintf(stderr, "Runtime error: out of memory\n");
+            exit(1);
+        }
+        add_chunk((char *)obj, slot, 0);
+    }
+    else
+    {
+        if (free_list[slot / GRANULE] == NULL)
+        {
+            char *start = malloc(CHUNK_SIZE);
+            if (start == NULL)
+            {
+                fprintf(stderr, "Runtime error: out of memory\n");
+                exit(1);
+            }
+            size_t count = CHUNK_SIZE / slot;
+            add_chunk(start, count * slot, slot);
+            // Pushed from the end, so cells are handed out in address order
+            for (size_t k = count; k-- > 0;)
+            {
+                char *p = start + k * slot;
+                *(int64_t *)p = 0;
+                *(void **)(p + GRANULE) = free_list[slot / GRANULE];
+                free_list[slot / GRANULE] = p;
+            }
+        }
+        obj = free_list[slot / GRANULE];
+        free_list[slot / GRANULE] = *(void **)(obj + 1);
+    }
+    memset(obj + 1, 0, slot - GRANULE);
+    *obj = (int64_t)layout;
+    return obj + 1;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Table of the cells interned with -fhash-cons, by constructor and
+// contents. Cells are compared byte by byte: their fields that are cells
+// are interned too, so equal values have equal bytes. Entries keep their
+// hash, so the table is rebuilt without looking at the cells, and the
+// collector of -fgc prunes the entries of dead cells before sweeping them.
+
+typedef struct entry
+{
+    uint64_t hash;
+    int64_t *cell;
+    int64_t size;
+    int64_t kind;
+} entry;
+
+static entry *table;
+static size_t count, capacity;
+
+static uint64_t hash_words(const int64_t *p, int64_t size, int64_t kind)
+{
+    uint64_t h = ((uint64_t)size ^ ((uint64_t)kind << 16)) * 0x9e3779b97f4a7c15ULL;
+    for (int64_t i = 0; i < size / 8; i++)
+    {
+        h = (h ^ (uint64_t)p[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    // Records with a small tag and small fields need not fill a word
+    const unsigned char *rest = (const unsigned char *)(p + size / 8);
+    for (int64_t i = 0; i < size % 8; i++)
+    {
+        h = (h ^ rest[i]) * 0xff51afd7ed558ccdULL;
+    }
+    return h;
+}
+
+static void place(entry e)
+{
+    size_t i = e.hash & (capacity - 1);
+    while (table[i].cell != NULL)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    table[i] = e;
+}
+
+static void resize(size_t new_capacity)
+{
+    entry *old = table;
+    size_t old_capacity = capacity;
+    table = calloc(new_capacity, sizeof(entry));
+    if (table == NULL)
+    {
+        fprintf(stderr, "Runtime error: out of memory\n");
+        exit(1);
+    }
+    capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].cell != NULL)
+        {
+            place(old[i]);
+        }
+    }
+    free(old);
+}
+
+// The interned cell of the same constructor equal to the candidate, or null
+int64_t *llama_hc_find(const int64_t *cand, int64_t size, int64_t kind)
+{
+    if (count == 0)
+    {
+        return NULL;
+    }
+    uint64_t h = hash_words(cand, size, kind);
+    for (size_t i = h & (capacity - 1); table[i].cell != NULL; i = (i + 1) & (capacity - 1))
+    {
+        if (table[i].hash == h && table[i].size == size && table[i].kind == kind && memcmp(table[i].cell, cand, size) == 0)
+        {
+            return table[i].cell;
+        }
+    }
+    return NULL;
+}
+
+void llama_hc_insert(int64_t *cell, int64_t size, int64_t kind)
+{
+    if (2 * (count + 1) > capacity)
+    {
+        resize(capacity ? 2 * capacity : 1024);
+    }
+    place((entry){hash_words(cell, size, kind), cell, size, kind});
+    count++;
+}
+
+// Drop the entries of the cells the collector did not mark, whose header
+// word in front of them has the low bit clear
+void llama_hc_prune()
+{
+    if (count == 0)
+    {
+        return;
+    }
+    size_t live = 0;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        if (table[i].cell != NULL && (table[i].cell[-1] & 1))
+        {
+            table[live++] = table[i];
+        }
+    }
+    entry *kept = malloc(live * sizeof(entry) + 1);
+    if (kept == NULL)
+    {
+        fprintf(stderr, "Runtime error: out of memory\n");
+        exit(1);
+    }
+    memcpy(kept, table, live * sizeof(entry));
+    memset(table, 0, capacity * sizeof(entry));
+    for (size_t i = 0; i < live; i++)
+    {
+        place(kept[i]);
+    }
+    free(kept);
+    count = live;
+}
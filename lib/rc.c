@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// Freeing of cells counted with -frc. A cell is preceded by the words
+// {layout, count}, the layout being {dims, size, count, offsets...} as with
+// -fgc, where the offsets locate the fields holding other cells. A count of
+// 0 marks a shared constant. Cells whose count drops to zero are freed from
+// an explicit stack, so a long list does not overflow the C stack.
+
+#define GRANULE 8
+#define TAGS 8
+
+void llama_free(void *p, int64_t size);
+
+static int64_t **pending;
+static size_t top, max;
+
+static void release_fields(int64_t *p)
+{
+    const int64_t *layout = (const int64_t *)p[-2];
+    for (int64_t i = 0; i < layout[2]; i++)
+    {
+        // Without the constructor's tag in its low bits
+        int64_t *field = (int64_t *)(*(intptr_t *)((char *)p + layout[3 + i]) & ~(intptr_t)(TAGS - 1));
+        if (field == NULL || field[-1] == 0 || --field[-1] > 0)
+        {
+            continue;
+        }
+        if (top == max)
+        {
+            max = max ? 2 * max : 64;
+            pending = realloc(pending, max * sizeof(int64_t *));
+            if (pending == NULL)
+            {
+                fprintf(stderr, "Runtime error: out of memory\n");
+                exit(1);
+            }
+        }
+        pending[top++] = field;
+    }
+}
+
+static void free_cell(int64_t *p)
+{
+    const int64_t *layout = (const int64_t *)p[-2];
+    llama_free(p - 2, (layout[1] + GRANULE - 1) / GRANULE * GRANULE + 2 * GRANULE);
+}
+
+static void free_pending()
+{
+    while (top > 0)
+    {
+        int64_t *p = pending[--top];
+        release_fields(p);
+        free_cell(p);
+    }
+}
+
+// The last reference to p is gone
+void llama_rc_free(int64_t *p)
+{
+    release_fields(p);
+    free_cell(p);
+    free_pending();
+}
+
+// The last reference to p is gone, but its cell is about to be reused
+void llama_rc_drop_fields(int64_t *p)
+{
+    release_fields(p);
+    free_pending();
+}
+
+// A cell kept for reuse that no constructor took
+void llama_rc_release(int64_t *p)
+{
+    if (p != NULL)
+    {
+        free_cell(p);
+    }
+}
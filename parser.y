@@ -2,10 +2,16 @@
 #include <cstdio>
 #include "ast.hpp"
 #include "lexer.hpp"
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/Signals.h>
 
+extern FILE *yyin;
 Program *prog;
 SymbolTable st;
 TypeDefTable tt;
+FunctionTable ft;
 %}
 
 %token T_and
@@ -123,9 +129,9 @@ TypeDefTable tt;
 %type<tdef> tdef 
 %type<constr_vec> constr_list
 %type<constr> constr
-%type<type_vec> constr_type_list
+%type<type_vec> constr_type_list star_type_list
 %type<par> par
-%type<type> type
+%type<type> type simple_type
 %type<stars> comma_star_list
 %type<expr> expr expr1 expr2 expr3 expr4 expr5
 %type<int_expr> T_int_expr
@@ -136,7 +142,7 @@ TypeDefTable tt;
 %type<pattern> pattern pattern1
 %type<clause> clause
 %type<clause_vec> or_clause_list
-%type<pattern_vec> pattern_list
+%type<pattern_vec> pattern_list comma_pattern_list
 
 %%
 
@@ -216,16 +222,26 @@ par:
 ;
 
 type:
+  simple_type { $$ = $1; }
+| star_type_list { $$ = new Type_Tuple($1); }
+| type T_arrow_op type { $$ = new Type_Func($1, $3); }
+;
+
+star_type_list:
+  simple_type '*' simple_type { $$ = new std::vector<::Type *>; $$->push_back($1); $$->push_back($3); }
+| star_type_list '*' simple_type { $1->push_back($3); $$ = $1; }
+;
+
+simple_type:
   T_unit { $$ = new Type_Unit(); }
 | T_int { $$ = new Type_Int(); }
 | T_char { $$ = new Type_Char(); }
 | T_bool { $$ = new Type_Bool(); }
 | T_float { $$ = new Type_Float(); }
 | '(' type ')' { $$ = $2; }
-| type T_arrow_op type { $$ = new Type_Func($1, $3); }
-| type T_ref { $$ = new Type_Ref($1); }
-| T_array T_of type { $$ = new Type_Array(1, $3); }
-| T_array '[' comma_star_list ']' T_of type { $$ = new Type_Array($3, $6); }
+| simple_type T_ref { $$ = new Type_Ref($1); }
+| T_array T_of simple_type { $$ = new Type_Array(1, $3); }
+| T_array '[' comma_star_list ']' T_of simple_type { $$ = new Type_Array($3, $6); }
 | T_id { $$ = new Type_id($1); }
 ;
 
@@ -249,11 +265,12 @@ expr1:
 | T_false { $$ = new Bool_Expr(false); }
 | '(' ')' { $$ = new Unit_Expr(); }
 | '(' expr ')' { $$ = $2; }
+| '(' expr ',' comma_expr_list ')' { $4->insert($4->begin(), $2); $$ = new Tuple($4); }
 | T_begin expr T_end { $$ = $2; }
 | T_id '[' comma_expr_list ']' { $$ = new Array($1, $3); }
 | T_dim T_id { $$ = new Dim($2); }
 | T_dim T_int_expr T_id { $$ = new Dim($3, $2); }
-| T_new type { $$ = new New($2); }
+| T_new simple_type { $$ = new New($2); }
 | T_id { $$ = new id_Expr($1); }
 | T_Id { $$ = new Id_Expr($1); }
 | '!' expr1 { $$ = new UnOp(unop_exclamation, $2); }
@@ -341,6 +358,7 @@ pattern1:
 | T_false { $$ = new Pattern_Bool_Expr(false); }
 | T_id { $$ = new Pattern_id($1); }
 | '(' pattern ')' { $$ = $2; }
+| '(' pattern ',' comma_pattern_list ')' { $4->insert($4->begin(), $2); $$ = new Pattern_Tuple($4); }
 | T_Id { $$ = new Pattern_Id($1); }
 ;
 
@@ -349,14 +367,62 @@ pattern_list:
 | pattern_list pattern1 { $1->push_back($2); $$ = $1; }
 ;
 
+comma_pattern_list:
+  pattern { $$ = new std::vector<Pattern *>; $$->push_back($1); }
+| comma_pattern_list ',' pattern { $1->push_back($3); $$ = $1; }
+;
+
 %%
 
+// Link an object file with the runtime library found next to the compiler
+int link_program(const char *argv0, const std::string &obj_name, const std::string &exe_name)
+{
+  std::string self = llvm::sys::fs::getMainExecutable(argv0, (void *)&link_program);
+  llvm::SmallString<128> lib(llvm::sys::path::parent_path(self));
+  llvm::sys::path::append(lib, "lib", "lib.a");
+  llvm::ErrorOr<std::string> cc = llvm::sys::findProgramByName("cc");
+  if (!cc)
+  {
+    std::cerr << "Failed to find the system linker driver (cc)." << std::endl;
+    return 1;
+  }
+  llvm::StringRef args[] = {*cc, obj_name, lib.str(), "-o", exe_name, "-lm", "-no-pie"};
+  std::string message;
+  int result = llvm::sys::ExecuteAndWait(*cc, args, llvm::None, {}, 0, 0, &message);
+  if (result != 0)
+  {
+    std::cerr << "Failed to link the program. " << message << std::endl;
+  }
+  return result;
+}
+
+// The object file made for -o, removed however the compiler exits
+static std::string obj_name = "";
+
+static void remove_object()
+{
+  if (obj_name != "")
+  {
+    llvm::sys::fs::remove(obj_name);
+  }
+}
+
 int main(int argc, char *argv[])
 {
-  bool optimize = false;
+  int opt_level = 0;
+  std::string cpu = "generic";
+  std::string features = "";
   bool intermediate = false;
   bool final = false;
   bool print = false;
+  bool object = false;
+  bool run = false;
+  bool bounds_check = false;
+  bool gc = false;
+  bool rc = false;
+  bool hash_cons = false;
+  std::string cache_dir = "";
+  std::string exe_name = "";
   std::string filename = "";
   std::string name = "";
   std::error_code error;
@@ -365,7 +431,55 @@ int main(int argc, char *argv[])
   {
     if (strcmp(argv[i], "-O") == 0)
     {
-      optimize = true;
+      opt_level = 2;
+    }
+    else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0 || strcmp(argv[i], "-O3") == 0)
+    {
+      opt_level = argv[i][2] - '0';
+    }
+    else if (strncmp(argv[i], "-march=", 7) == 0)
+    {
+      cpu = argv[i] + 7;
+    }
+    else if (strncmp(argv[i], "-mcpu=", 6) == 0)
+    {
+      cpu = argv[i] + 6;
+    }
+    else if (strncmp(argv[i], "-mattr=", 7) == 0)
+    {
+      features = argv[i] + 7;
+    }
+    else if (strcmp(argv[i], "-c") == 0)
+    {
+      object = true;
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      exe_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "-fbounds-check") == 0)
+    {
+      bounds_check = true;
+    }
+    else if (strcmp(argv[i], "-fgc") == 0)
+    {
+      gc = true;
+    }
+    else if (strcmp(argv[i], "-frc") == 0)
+    {
+      rc = true;
+    }
+    else if (strcmp(argv[i], "-fhash-cons") == 0)
+    {
+      hash_cons = true;
+    }
+    else if (strcmp(argv[i], "--run") == 0)
+    {
+      run = true;
+    }
+    else if (strncmp(argv[i], "--cache-dir=", 12) == 0)
+    {
+      cache_dir = argv[i] + 12;
     }
     else if (strcmp(argv[i], "-f") == 0)
     {
@@ -385,12 +499,28 @@ int main(int argc, char *argv[])
       name = filename.substr(0, filename.find_last_of('.'));
     }
   }
-  if (!intermediate && !final && !print)
+  if (gc && rc)
+  {
+    std::cerr << "Options -fgc and -frc cannot be combined." << std::endl;
+    return 1;
+  }
+  if (hash_cons && rc)
+  {
+    std::cerr << "Options -fhash-cons and -frc cannot be combined." << std::endl;
+    return 1;
+  }
+  if (!intermediate && !final && !print && exe_name == "" && !run)
   {
     if (filename == "")
     {
-      std::cerr << "Usage: ./llama [-O] [-f | -i | -p]" << std::endl;
-      std::cerr << "Usage: ./llama [-O] <file>" << std::endl;
+      // The options every mode takes are listed once
+      const char *modes[] = {"[-c] [-f | -i | -p]", "[-c] <file>", "-o <exe> [<file>]", "--run [--cache-dir=<dir>] <file>"};
+      for (const char *mode : modes)
+      {
+        std::cerr << "Usage: ./llama [options] " << mode << std::endl;
+      }
+      std::cerr << "Options: [-O | -O0 | -O1 | -O2 | -O3] [-march=native | -mcpu=<cpu>] [-mattr=<features>]" << std::endl
+                << "         [-fbounds-check] [-fgc | -frc] [-fhash-cons]" << std::endl;
       return 1;
     }
     FILE *file = freopen(filename.c_str(), "r", stdin);
@@ -405,7 +535,7 @@ int main(int argc, char *argv[])
       llvm::errs() << "Error opening the file: " << error.message() << "\n";
       return 1;
     }
-    asm_file = new llvm::raw_fd_ostream(name + ".s", error);
+    asm_file = new llvm::raw_fd_ostream(name + (object ? ".o" : ".s"), error);
     if (error)
     {
       llvm::errs() << "Error opening the file: " << error.message() << "\n";
@@ -420,6 +550,21 @@ int main(int argc, char *argv[])
   {
     asm_file = &llvm::outs();
   }
+  if (exe_name != "" && filename != "" && freopen(filename.c_str(), "r", stdin) == nullptr)
+  {
+    std::cerr << "Failed to open the file." << std::endl;
+    return 1;
+  }
+  if (run && filename != "")
+  {
+    // The program keeps stdin for its own input
+    yyin = fopen(filename.c_str(), "r");
+    if (yyin == nullptr)
+    {
+      std::cerr << "Failed to open the file." << std::endl;
+      return 1;
+    }
+  }
   int result = yyparse();
   if (result != 0)
   {
@@ -430,6 +575,51 @@ int main(int argc, char *argv[])
   {
     std::cout << *prog;
   }
-  prog->llvm_compile_and_dump(optimize, imm_file, asm_file);
+  prog->simplify();
+  prog->lift();
+  if (bounds_check)
+  {
+    prog->bounds();
+  }
+  prog->escape();
+  if (gc)
+  {
+    prog->gc();
+  }
+  if (rc)
+  {
+    prog->rc();
+  }
+  if (hash_cons)
+  {
+    prog->hash_cons();
+  }
+  if (run)
+  {
+    return prog->llvm_run(opt_level, cpu, features, cache_dir);
+  }
+  if (exe_name != "")
+  {
+    // The object code goes to a temporary file which is then linked. It is
+    // made once the program is known to be correct
+    int fd;
+    llvm::SmallString<128> path;
+    if (llvm::sys::fs::createTemporaryFile("llama", "o", fd, path))
+    {
+      std::cerr << "Failed to create a temporary file." << std::endl;
+      return 1;
+    }
+    obj_name = path.str().str();
+    llvm::sys::RemoveFileOnSignal(obj_name);
+    std::atexit(remove_object);
+    asm_file = new llvm::raw_fd_ostream(fd, true);
+    object = true;
+  }
+  prog->llvm_compile_and_dump(opt_level, cpu, features, imm_file, asm_file, object);
+  if (exe_name != "")
+  {
+    delete asm_file;
+    return link_program(argv[0], obj_name, exe_name);
+  }
   return 0;
 }
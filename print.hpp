@@ -125,6 +125,11 @@ void Type_id::printOn(std::ostream &out) const
   out << "Type_id(" << id << ")";
 }
 
+void Type_Tuple::printOn(std::ostream &out) const
+{
+  out << "Type_Tuple(" << *type_vec << ")";
+}
+
 void Type_Undefined::printOn(std::ostream &out) const
 {
   if (typ == nullptr)
@@ -197,6 +202,11 @@ void Array::printOn(std::ostream &out) const
   out << "Array(" << id << ", [" << *expr_vec << "])";
 }
 
+void Tuple::printOn(std::ostream &out) const
+{
+  out << "Tuple(" << *expr_vec << ")";
+}
+
 void Dim::printOn(std::ostream &out) const
 {
   out << "Dim(" << ind << ", " << id << ")";
@@ -279,3 +289,8 @@ void Pattern_Call::printOn(std::ostream &out) const
 {
   out << "Pattern_Call(" << Id << ", (" << *pattern_vec << "))";
 }
+
+void Pattern_Tuple::printOn(std::ostream &out) const
+{
+  out << "Pattern_Tuple(" << *pattern_vec << ")";
+}
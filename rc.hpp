@@ -0,0 +1,549 @@
+#include "ast.hpp"
+
+// Reference counting for -frc. A cell of a data type is preceded by a
+// header {layout, count}, the layout being the one of -fgc restricted to
+// the fields that hold other cells, and a count of 0 marks the shared
+// constants, which are never freed. Each local of a function owns one
+// reference: it is handed over at the last use of the variable, copied at
+// the others, and dropped at the start of a branch that does not use it.
+// Top level bindings are only ever copied from. A cell dropped at the start
+// of a branch whose constructor is known is handed to the next constructor
+// of the same size in that branch, which rebuilds it in place when it was
+// the last reference (see lib/rc.c for the runtime half).
+
+bool AST::RC = false;
+std::set<std::string> AST::LiveAfter;
+std::vector<std::pair<Value *, uint64_t>> AST::ReuseTokens;
+std::map<std::string, ConstrEntry *> AST::KnownShape;
+std::vector<::Type *> AST::TupleTypes;
+
+void Program::rc()
+{
+  RC = true;
+  for (::Type *t : TupleTypes)
+  {
+    if (holdsADT(t))
+    {
+      semerror("Tuples holding data type values are not supported with -frc");
+    }
+  }
+}
+
+static std::set<std::string> minus(const std::set<std::string> &a, const std::set<std::string> &b)
+{
+  std::set<std::string> result;
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::inserter(result, result.end()));
+  return result;
+}
+
+bool AST::isADT(::Type *t) const
+{
+  return t != nullptr && t->get_type() == type_id && !unboxed(t->get_id());
+}
+
+// Whether a value of the type is or holds, through tuples, a counted reference
+bool AST::holdsADT(::Type *t) const
+{
+  if (t->get_type() != type_tuple)
+  {
+    return isADT(t);
+  }
+  for (int i = 0; i < t->getDim(); i++)
+  {
+    if (holdsADT(t->getChild(i)))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool AST::owned(const std::string &id) const
+{
+  return RC && ft.isLocal(id) && isADT(ft.localType(id));
+}
+
+std::set<std::string> AST::usesOf(const Expr *e) const
+{
+  std::set<std::string> vars;
+  if (RC && e != nullptr)
+  {
+    e->uses(vars);
+  }
+  return vars;
+}
+
+Value *AST::compileLive(Expr *e, const std::set<std::string> &later) const
+{
+  std::set<std::string> prev = LiveAfter;
+  LiveAfter.insert(later.begin(), later.end());
+  Value *v = e->compile();
+  LiveAfter = prev;
+  return v;
+}
+
+std::vector<Value *> AST::compileArgs(const std::vector<Expr *> &args) const
+{
+  // Each argument is compiled knowing what the ones after it read
+  std::vector<std::set<std::string>> later(args.size() + 1);
+  for (size_t i = args.size(); RC && i > 0; i--)
+  {
+    later[i - 1] = later[i];
+    args[i - 1]->uses(later[i - 1]);
+  }
+  std::vector<Value *> value_vec;
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    value_vec.push_back(compileLive(args[i], later[i + 1]));
+  }
+  return value_vec;
+}
+
+void AST::dup(Value *v) const
+{
+  Builder.CreateCall(TheModule->getFunction("llama_dup"), {v});
+}
+
+void AST::drop(Value *v) const
+{
+  Builder.CreateCall(TheModule->getFunction("llama_drop"), {v});
+}
+
+void AST::dropReuse(Value *v, ConstrEntry *shape) const
+{
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock &EntryBB = TheFunction->getEntryBlock();
+  IRBuilder<> TmpB(&EntryBB, EntryBB.begin());
+  Value *slot = TmpB.CreateAlloca(PointerType::get(i64, 0), nullptr, "reuse");
+  Builder.CreateStore(Builder.CreateCall(TheModule->getFunction("llama_drop_reuse"), {v}), slot);
+  ReuseTokens.push_back({slot, cellSize(shape)});
+}
+
+void AST::dropVars(const std::set<std::string> &vars, const std::set<std::string> &keep) const
+{
+  for (const std::string &x : vars)
+  {
+    if (!owned(x) || LiveAfter.count(x) > 0 || keep.count(x) > 0)
+    {
+      continue;
+    }
+    Value *v = Builder.CreateLoad(getVariable(x));
+    auto shape = KnownShape.find(x);
+    if (shape != KnownShape.end())
+    {
+      dropReuse(v, shape->second);
+    }
+    else
+    {
+      drop(v);
+    }
+  }
+}
+
+Value *AST::takeToken(uint64_t size) const
+{
+  for (auto it = ReuseTokens.rbegin(); it != ReuseTokens.rend(); it++)
+  {
+    if (it->second == size)
+    {
+      Value *cell = Builder.CreateLoad(it->first, "reused");
+      Builder.CreateStore(ConstantPointerNull::get(PointerType::get(i64, 0)), it->first);
+      return cell;
+    }
+  }
+  return ConstantPointerNull::get(PointerType::get(i64, 0));
+}
+
+void AST::releaseTokens(size_t mark) const
+{
+  // Cells no constructor took are given back
+  while (ReuseTokens.size() > mark)
+  {
+    Builder.CreateCall(TheModule->getFunction("llama_rc_release"), {Builder.CreateLoad(ReuseTokens.back().first)});
+    ReuseTokens.pop_back();
+  }
+}
+
+void AST::releaseAllTokens() const
+{
+  for (auto &token : ReuseTokens)
+  {
+    Builder.CreateCall(TheModule->getFunction("llama_rc_release"), {Builder.CreateLoad(token.first)});
+    Builder.CreateStore(ConstantPointerNull::get(PointerType::get(i64, 0)), token.first);
+  }
+}
+
+uint64_t AST::cellSize(ConstrEntry *e) const
+{
+  uint64_t size = TheModule->getDataLayout().getTypeAllocSize(e->structType);
+  return (size + Granule - 1) / Granule * Granule;
+}
+
+Value *AST::allocateCell(ConstrEntry *e, Value *reuse) const
+{
+  // The layout lists the fields that hold cells of data types
+  const StructLayout *sl = TheModule->getDataLayout().getStructLayout(e->structType);
+  std::vector<uint64_t> offs;
+  for (size_t i = 0; i < e->fields.size(); i++)
+  {
+    if (isADT(e->fields[i]))
+    {
+      offs.push_back(sl->getElementOffset(e->slots[i]));
+    }
+  }
+  Constant *cell_layout = layout(sl->getSizeInBytes(), 0, offs);
+  uint64_t size = cellSize(e) + 2 * Granule;
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  BasicBlock *PrevBB = Builder.GetInsertBlock();
+  BasicBlock *AllocBB = BasicBlock::Create(TheContext, "alloc", TheFunction);
+  BasicBlock *InitBB = BasicBlock::Create(TheContext, "init", TheFunction);
+  Builder.CreateCondBr(Builder.CreateIsNull(reuse), AllocBB, InitBB);
+  Builder.SetInsertPoint(AllocBB);
+  Function *alloc = TheModule->getFunction(size > MaxSmall ? "malloc" : "llama_alloc");
+  Value *fresh = Builder.CreateGEP(Builder.CreateCall(alloc, {c64(size)}), {c64(2)});
+  Builder.CreateBr(InitBB);
+  Builder.SetInsertPoint(InitBB);
+  PHINode *cell = Builder.CreatePHI(PointerType::get(i64, 0), 2, "cell");
+  cell->addIncoming(reuse, PrevBB);
+  cell->addIncoming(fresh, AllocBB);
+  Builder.CreateStore(Builder.CreatePtrToInt(cell_layout, i64), Builder.CreateGEP(cell, {c64(-2)}));
+  Builder.CreateStore(c64(1), Builder.CreateGEP(cell, {c64(-1)}));
+  return cell;
+}
+
+// The cell a value points to, without the tag of its constructor
+Value *AST::untag(Value *v) const
+{
+  Value *bits = Builder.CreateAnd(Builder.CreatePtrToInt(v, i64), c64(-PointerTags));
+  return Builder.CreateIntToPtr(bits, PointerType::get(i64, 0));
+}
+
+void Program::llvm_rc_runtime()
+{
+  PointerType *i64p = PointerType::get(i64, 0);
+  llvm::Type *void_type = llvm::Type::getVoidTy(TheContext);
+  FunctionType *free_type = FunctionType::get(voi, {i64p}, false);
+  Function::Create(free_type, Function::ExternalLinkage, "llama_rc_free", TheModule.get());
+  Function::Create(free_type, Function::ExternalLinkage, "llama_rc_drop_fields", TheModule.get());
+  Function::Create(free_type, Function::ExternalLinkage, "llama_rc_release", TheModule.get());
+  // Copying a reference bumps the count, unless the cell is a constant
+  FunctionType *dup_type = FunctionType::get(void_type, {i64p}, false);
+  Function *func = Function::Create(dup_type, Function::InternalLinkage, "llama_dup", TheModule.get());
+  func->addFnAttr(Attribute::AlwaysInline);
+  BasicBlock *EntryBB = BasicBlock::Create(TheContext, "entry", func);
+  BasicBlock *CountedBB = BasicBlock::Create(TheContext, "counted", func);
+  BasicBlock *IncBB = BasicBlock::Create(TheContext, "inc", func);
+  BasicBlock *DoneBB = BasicBlock::Create(TheContext, "done", func);
+  Builder.SetInsertPoint(EntryBB);
+  Value *p = untag(func->arg_begin());
+  Builder.CreateCondBr(Builder.CreateIsNull(p), DoneBB, CountedBB);
+  Builder.SetInsertPoint(CountedBB);
+  Value *count_ptr = Builder.CreateGEP(p, {c64(-1)});
+  Value *count = Builder.CreateLoad(count_ptr, "count");
+  Builder.CreateCondBr(Builder.CreateICmpEQ(count, c64(0)), DoneBB, IncBB);
+  Builder.SetInsertPoint(IncBB);
+  Builder.CreateStore(Builder.CreateAdd(count, c64(1)), count_ptr);
+  Builder.CreateBr(DoneBB);
+  Builder.SetInsertPoint(DoneBB);
+  Builder.CreateRetVoid();
+  // Dropping the last reference frees the cell and drops its fields
+  func = Function::Create(dup_type, Function::InternalLinkage, "llama_drop", TheModule.get());
+  func->addFnAttr(Attribute::AlwaysInline);
+  EntryBB = BasicBlock::Create(TheContext, "entry", func);
+  CountedBB = BasicBlock::Create(TheContext, "counted", func);
+  BasicBlock *DecBB = BasicBlock::Create(TheContext, "dec", func);
+  BasicBlock *LastBB = BasicBlock::Create(TheContext, "last", func);
+  BasicBlock *FreeBB = BasicBlock::Create(TheContext, "free", func);
+  DoneBB = BasicBlock::Create(TheContext, "done", func);
+  Builder.SetInsertPoint(EntryBB);
+  p = untag(func->arg_begin());
+  Builder.CreateCondBr(Builder.CreateIsNull(p), DoneBB, CountedBB);
+  Builder.SetInsertPoint(CountedBB);
+  count_ptr = Builder.CreateGEP(p, {c64(-1)});
+  count = Builder.CreateLoad(count_ptr, "count");
+  Builder.CreateCondBr(Builder.CreateICmpUGT(count, c64(1)), DecBB, LastBB);
+  Builder.SetInsertPoint(DecBB);
+  Builder.CreateStore(Builder.CreateSub(count, c64(1)), count_ptr);
+  Builder.CreateBr(DoneBB);
+  Builder.SetInsertPoint(LastBB);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(count, c64(1)), FreeBB, DoneBB);
+  Builder.SetInsertPoint(FreeBB);
+  Builder.CreateCall(TheModule->getFunction("llama_rc_free"), {p});
+  Builder.CreateBr(DoneBB);
+  Builder.SetInsertPoint(DoneBB);
+  Builder.CreateRetVoid();
+  // Same, but the cell of a last reference is returned for reuse instead of
+  // freed, and null otherwise
+  FunctionType *reuse_type = FunctionType::get(i64p, {i64p}, false);
+  func = Function::Create(reuse_type, Function::InternalLinkage, "llama_drop_reuse", TheModule.get());
+  func->addFnAttr(Attribute::AlwaysInline);
+  EntryBB = BasicBlock::Create(TheContext, "entry", func);
+  CountedBB = BasicBlock::Create(TheContext, "counted", func);
+  BasicBlock *UniqueBB = BasicBlock::Create(TheContext, "unique", func);
+  BasicBlock *SharedBB = BasicBlock::Create(TheContext, "shared", func);
+  DecBB = BasicBlock::Create(TheContext, "dec", func);
+  DoneBB = BasicBlock::Create(TheContext, "done", func);
+  Builder.SetInsertPoint(EntryBB);
+  p = untag(func->arg_begin());
+  Builder.CreateCondBr(Builder.CreateIsNull(p), DoneBB, CountedBB);
+  Builder.SetInsertPoint(CountedBB);
+  count_ptr = Builder.CreateGEP(p, {c64(-1)});
+  count = Builder.CreateLoad(count_ptr, "count");
+  Builder.CreateCondBr(Builder.CreateICmpEQ(count, c64(1)), UniqueBB, SharedBB);
+  Builder.SetInsertPoint(UniqueBB);
+  Builder.CreateCall(TheModule->getFunction("llama_rc_drop_fields"), {p});
+  Builder.CreateRet(p);
+  Builder.SetInsertPoint(SharedBB);
+  Builder.CreateCondBr(Builder.CreateICmpUGT(count, c64(1)), DecBB, DoneBB);
+  Builder.SetInsertPoint(DecBB);
+  Builder.CreateStore(Builder.CreateSub(count, c64(1)), count_ptr);
+  Builder.CreateBr(DoneBB);
+  Builder.SetInsertPoint(DoneBB);
+  Builder.CreateRet(ConstantPointerNull::get(i64p));
+}
+
+// Variables read, with the locals of the functions called, less the ones
+// bound inside
+
+void UnOp::uses(std::set<std::string> &vars) const
+{
+  expr->uses(vars);
+}
+
+void BinOp::uses(std::set<std::string> &vars) const
+{
+  left->uses(vars);
+  right->uses(vars);
+}
+
+void id_Expr::uses(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+  FunctionEntry *fe = ft.lookup(id);
+  if (fe != nullptr)
+  {
+    vars.insert(fe->captures.begin(), fe->captures.end());
+  }
+}
+
+void call::uses(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+  FunctionEntry *fe = ft.lookup(id);
+  if (fe != nullptr)
+  {
+    vars.insert(fe->captures.begin(), fe->captures.end());
+  }
+  for (Expr *e : *expr_vec)
+  {
+    e->uses(vars);
+  }
+}
+
+void Array::uses(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+  for (Expr *e : *expr_vec)
+  {
+    e->uses(vars);
+  }
+}
+
+void Tuple::uses(std::set<std::string> &vars) const
+{
+  for (Expr *e : *expr_vec)
+  {
+    e->uses(vars);
+  }
+}
+
+void If::uses(std::set<std::string> &vars) const
+{
+  expr1->uses(vars);
+  expr2->uses(vars);
+  if (expr3 != nullptr)
+  {
+    expr3->uses(vars);
+  }
+}
+
+void While::uses(std::set<std::string> &vars) const
+{
+  cond->uses(vars);
+  stmt->uses(vars);
+}
+
+void For::uses(std::set<std::string> &vars) const
+{
+  start->uses(vars);
+  end->uses(vars);
+  std::set<std::string> body;
+  stmt->uses(body);
+  body.erase(id);
+  vars.insert(body.begin(), body.end());
+}
+
+void Match::uses(std::set<std::string> &vars) const
+{
+  expr->uses(vars);
+  for (Clause *cl : *clause_vec)
+  {
+    cl->uses(vars);
+  }
+}
+
+void Clause::uses(std::set<std::string> &vars) const
+{
+  std::set<std::string> body, bound;
+  expr->uses(body);
+  pat->binds(bound);
+  body = minus(body, bound);
+  vars.insert(body.begin(), body.end());
+}
+
+void Pattern_id::binds(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+}
+
+void Pattern_Call::binds(std::set<std::string> &vars) const
+{
+  for (Pattern *pat : *pattern_vec)
+  {
+    pat->binds(vars);
+  }
+}
+
+void Pattern_Tuple::binds(std::set<std::string> &vars) const
+{
+  for (Pattern *pat : *pattern_vec)
+  {
+    pat->binds(vars);
+  }
+}
+
+void NormalDef::uses(std::set<std::string> &vars) const
+{
+  // A function's body counts where it is called
+  if (par_vec->size() == 0)
+  {
+    expr->uses(vars);
+  }
+}
+
+void NormalDef::binds(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+}
+
+void MutableDef::uses(std::set<std::string> &vars) const
+{
+  if (expr_vec != nullptr)
+  {
+    for (Expr *e : *expr_vec)
+    {
+      e->uses(vars);
+    }
+  }
+}
+
+void MutableDef::binds(std::set<std::string> &vars) const
+{
+  vars.insert(id);
+}
+
+void LetDef::uses(std::set<std::string> &vars) const
+{
+  for (Def *def : *def_vec)
+  {
+    def->uses(vars);
+  }
+}
+
+void LetDef::binds(std::set<std::string> &vars) const
+{
+  for (Def *def : *def_vec)
+  {
+    def->binds(vars);
+  }
+}
+
+void LetIn::uses(std::set<std::string> &vars) const
+{
+  std::set<std::string> inner, bound;
+  letdef->uses(inner);
+  expr->uses(inner);
+  letdef->binds(bound);
+  inner = minus(inner, bound);
+  vars.insert(inner.begin(), inner.end());
+}
+
+void Match::enter_clause(size_t i, Value *v, const std::set<std::string> &all) const
+{
+  Clause *cl = (*clause_vec)[i];
+  std::set<std::string> mine, body, bound;
+  cl->uses(mine);
+  cl->expr->uses(body);
+  cl->pat->binds(bound);
+  std::string x;
+  bool borrowed = expr->get_var(x) && owned(x);
+  std::set<std::string> keep = mine;
+  if (borrowed)
+  {
+    keep.insert(x);
+  }
+  if (isADT(expr->typ))
+  {
+    // The bound fields get references of their own while the scrutinee
+    // still holds its
+    std::set<std::string> kept;
+    for (const std::string &b : bound)
+    {
+      if (owned(b) && body.count(b) > 0)
+      {
+        kept.insert(b);
+      }
+    }
+    ConstrEntry *shape = nullptr;
+    if (Pattern_Call *pc = dynamic_cast<Pattern_Call *>(cl->pat))
+    {
+      shape = pc->shape();
+    }
+    bool live = borrowed && (mine.count(x) > 0 || LiveAfter.count(x) > 0);
+    if (live)
+    {
+      for (const std::string &b : kept)
+      {
+        dup(Builder.CreateLoad(getVariable(b)));
+      }
+      if (shape != nullptr)
+      {
+        KnownShape[x] = shape;
+      }
+    }
+    else if (cl->pat->is_wildcard() && !bound.empty())
+    {
+      // The binding takes over the scrutinee's reference
+      if (kept.empty())
+      {
+        drop(v);
+      }
+    }
+    else
+    {
+      for (const std::string &b : kept)
+      {
+        dup(Builder.CreateLoad(getVariable(b)));
+      }
+      if (shape != nullptr)
+      {
+        dropReuse(v, shape);
+      }
+      else
+      {
+        drop(v);
+      }
+    }
+  }
+  dropVars(all, keep);
+}
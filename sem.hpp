@@ -217,6 +217,7 @@ void Constr::sem()
     tmp = new Type_Func(*i, tmp);
   }
   st.insert(Id, tmp);
+  entry = tt.insertConstructor(id, Id, *type_vec);
 }
 
 void Par::sem()
@@ -235,6 +236,11 @@ void Par::sem()
   return nullptr;
 }
 
+::Type * ::Type::getChild(int i)
+{
+  return nullptr;
+}
+
 int ::Type::getDim()
 {
   return 0;
@@ -422,6 +428,53 @@ void Type_id::sem()
   tt.lookup(id);
 }
 
+main_type Type_Tuple::get_type()
+{
+  return type_tuple;
+}
+
+::Type *Type_Tuple::getChild(int i)
+{
+  return (*type_vec)[i];
+}
+
+int Type_Tuple::getDim()
+{
+  return type_vec->size();
+}
+
+bool Type_Tuple::equals(::Type *other)
+{
+  if (other == nullptr)
+  {
+    return false;
+  }
+  if (other->get_type() == type_undefined)
+  {
+    return other->equals(this);
+  }
+  if (this->get_type() != other->get_type() || getDim() != other->getDim())
+  {
+    return false;
+  }
+  for (int i = 0; i < getDim(); i++)
+  {
+    if (!(*type_vec)[i]->equals(other->getChild(i)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Type_Tuple::sem()
+{
+  for (::Type *t : *type_vec)
+  {
+    t->sem();
+  }
+}
+
 main_type Type_Undefined::get_type()
 {
   return typ == nullptr ? type_undefined : typ->get_type();
@@ -437,6 +490,11 @@ main_type Type_Undefined::get_type()
   return typ == nullptr ? nullptr : typ->getChild2();
 }
 
+::Type *Type_Undefined::getChild(int i)
+{
+  return typ == nullptr ? nullptr : typ->getChild(i);
+}
+
 int Type_Undefined::getDim()
 {
   return typ == nullptr ? 0 : typ->getDim();
@@ -631,6 +689,7 @@ void id_Expr::sem()
 void Id_Expr::sem()
 {
   typ = st.lookup(Id)->type;
+  entry = tt.lookupConstructor(Id);
 }
 
 void call::sem()
@@ -673,6 +732,18 @@ void Array::sem()
   typ = new Type_Ref(typ->getChild1());
 }
 
+void Tuple::sem()
+{
+  std::vector<::Type *> *type_vec = new std::vector<::Type *>;
+  for (Expr *e : *expr_vec)
+  {
+    e->sem();
+    type_vec->push_back(e->typ);
+  }
+  typ = new Type_Tuple(type_vec);
+  TupleTypes.push_back(typ);
+}
+
 void Dim::sem()
 {
   SymbolEntry *se = st.lookup(id);
@@ -747,6 +818,93 @@ void For::sem()
   typ = new Type_Unit();
 }
 
+// Usefulness of a pattern vector against a pattern matrix (Maranget),
+// with nullptr standing for a wildcard
+
+static bool wild(Pattern *p)
+{
+  return p == nullptr || p->is_wildcard();
+}
+
+// Rows of the matrix that can match constructor c with the given arity,
+// with its sub-patterns in place of the first column
+static std::vector<std::vector<Pattern *>> specialize(const std::vector<std::vector<Pattern *>> &matrix, const std::string &c, int arity)
+{
+  std::vector<std::vector<Pattern *>> result;
+  for (const std::vector<Pattern *> &row : matrix)
+  {
+    std::vector<Pattern *> r;
+    if (wild(row[0]))
+    {
+      r.assign(arity, nullptr);
+    }
+    else if (row[0]->get_head() == c)
+    {
+      r = row[0]->get_args();
+    }
+    else
+    {
+      continue;
+    }
+    r.insert(r.end(), row.begin() + 1, row.end());
+    result.push_back(r);
+  }
+  return result;
+}
+
+static bool useful(const std::vector<std::vector<Pattern *>> &matrix, const std::vector<Pattern *> &q)
+{
+  if (q.empty())
+  {
+    return matrix.empty();
+  }
+  if (!wild(q[0]))
+  {
+    std::vector<Pattern *> r = q[0]->get_args();
+    r.insert(r.end(), q.begin() + 1, q.end());
+    return useful(specialize(matrix, q[0]->get_head(), q[0]->get_args().size()), r);
+  }
+  // The constructors in the first column, and all those of its type
+  std::set<std::string> heads;
+  std::vector<std::pair<std::string, int>> signature;
+  for (const std::vector<Pattern *> &row : matrix)
+  {
+    if (!wild(row[0]))
+    {
+      heads.insert(row[0]->get_head());
+      signature = row[0]->get_signature();
+    }
+  }
+  bool complete = !signature.empty();
+  for (auto &c : signature)
+  {
+    complete = complete && heads.count(c.first) > 0;
+  }
+  if (complete)
+  {
+    for (auto &c : signature)
+    {
+      std::vector<Pattern *> r(c.second, nullptr);
+      r.insert(r.end(), q.begin() + 1, q.end());
+      if (useful(specialize(matrix, c.first, c.second), r))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+  // Default matrix: the rows starting with a wildcard
+  std::vector<std::vector<Pattern *>> rest;
+  for (const std::vector<Pattern *> &row : matrix)
+  {
+    if (wild(row[0]))
+    {
+      rest.push_back(std::vector<Pattern *>(row.begin() + 1, row.end()));
+    }
+  }
+  return useful(rest, std::vector<Pattern *>(q.begin() + 1, q.end()));
+}
+
 void Match::sem()
 {
   expr->sem();
@@ -760,6 +918,18 @@ void Match::sem()
     st.closeScope();
   }
   typ = ((*clause_vec)[0])->expr->typ;
+  // A clause is redundant if no value reaching it is matched by it, and the
+  // match is exhaustive if no value reaches past the last clause
+  std::vector<std::vector<Pattern *>> matrix;
+  for (Clause *cl : *clause_vec)
+  {
+    if (!useful(matrix, {cl->pat}))
+    {
+      std::cerr << "Warning: Redundant match clause " << *cl->pat << std::endl;
+    }
+    matrix.push_back({cl->pat});
+  }
+  exhaustive = !useful(matrix, {nullptr});
 }
 
 void Clause::sem()
@@ -797,11 +967,13 @@ void Pattern_id::sem()
 void Pattern_Id::sem()
 {
   typ = st.lookup(Id)->type;
+  entry = tt.lookupConstructor(Id);
 }
 
 void Pattern_Call::sem()
 {
   ::Type *tmp = st.lookup(Id)->type;
+  entry = tt.lookupConstructor(Id);
   for (Pattern *pat : *pattern_vec)
   {
     pat->sem();
@@ -824,3 +996,92 @@ void Pattern_Call::sem()
   }
   typ = tmp;
 }
+
+void Pattern_Tuple::sem()
+{
+  std::vector<::Type *> *type_vec = new std::vector<::Type *>;
+  for (Pattern *pat : *pattern_vec)
+  {
+    pat->sem();
+    type_vec->push_back(pat->typ);
+  }
+  typ = new Type_Tuple(type_vec);
+}
+
+std::string Pattern_Int_Expr::get_head() const
+{
+  return std::to_string(num);
+}
+
+std::string Pattern_Float_Expr::get_head() const
+{
+  std::ostringstream out;
+  out << std::hexfloat << num;
+  return out.str();
+}
+
+std::string Pattern_Char_Expr::get_head() const
+{
+  return std::string(1, ch);
+}
+
+std::string Pattern_Bool_Expr::get_head() const
+{
+  return boolean ? "true" : "false";
+}
+
+std::vector<std::pair<std::string, int>> Pattern_Bool_Expr::get_signature() const
+{
+  return {{"true", 0}, {"false", 0}};
+}
+
+std::string Pattern_Id::get_head() const
+{
+  return Id;
+}
+
+std::vector<std::pair<std::string, int>> Pattern_Id::get_signature() const
+{
+  std::vector<std::pair<std::string, int>> signature;
+  for (ConstrEntry *c : tt.getConstructors(entry->type))
+  {
+    signature.push_back({c->Id, c->fields.size()});
+  }
+  return signature;
+}
+
+std::string Pattern_Call::get_head() const
+{
+  return Id;
+}
+
+std::vector<Pattern *> Pattern_Call::get_args() const
+{
+  return *pattern_vec;
+}
+
+std::vector<std::pair<std::string, int>> Pattern_Call::get_signature() const
+{
+  std::vector<std::pair<std::string, int>> signature;
+  for (ConstrEntry *c : tt.getConstructors(entry->type))
+  {
+    signature.push_back({c->Id, c->fields.size()});
+  }
+  return signature;
+}
+
+// A tuple is the only constructor of its type
+std::string Pattern_Tuple::get_head() const
+{
+  return ",";
+}
+
+std::vector<Pattern *> Pattern_Tuple::get_args() const
+{
+  return *pattern_vec;
+}
+
+std::vector<std::pair<std::string, int>> Pattern_Tuple::get_signature() const
+{
+  return {{",", static_cast<int>(pattern_vec->size())}};
+}
@@ -0,0 +1,259 @@
+#include "ast.hpp"
+
+// Case of known constructor: a match whose scrutinee is built by a known
+// constructor, directly or through a constant binding, is replaced by the
+// clause it selects, with its variables bound to the constructor's
+// arguments. The value that would be built and taken apart again is then
+// never allocated. A tuple written in the scrutinee is taken apart alike.
+
+std::map<std::string, Expr *> AST::KnownValues;
+
+// Whether copying the expression to another use changes nothing
+static bool atom(Expr *e)
+{
+  std::string x;
+  int n;
+  return e->get_int(n) || (e->get_var(x) && e->typ->get_type() != type_func);
+}
+
+void Program::simplify()
+{
+  for (Stmt *stmt : *statements)
+  {
+    stmt->simplify();
+  }
+}
+
+void LetDef::simplify()
+{
+  for (Def *def : *def_vec)
+  {
+    def->simplify();
+  }
+}
+
+void NormalDef::simplify()
+{
+  expr = expr->simplified();
+  std::vector<Expr *> args;
+  if (par_vec->size() == 0 && expr->get_constr(args) != nullptr && std::all_of(args.begin(), args.end(), atom))
+  {
+    KnownValues[id] = expr;
+  }
+}
+
+void MutableDef::simplify()
+{
+  if (expr_vec != nullptr)
+  {
+    for (Expr *&e : *expr_vec)
+    {
+      e = e->simplified();
+    }
+  }
+}
+
+Expr *LetIn::simplified()
+{
+  letdef->simplify();
+  expr = expr->simplified();
+  return this;
+}
+
+Expr *UnOp::simplified()
+{
+  expr = expr->simplified();
+  return this;
+}
+
+Expr *BinOp::simplified()
+{
+  left = left->simplified();
+  right = right->simplified();
+  return this;
+}
+
+Expr *call::simplified()
+{
+  for (Expr *&e : *expr_vec)
+  {
+    e = e->simplified();
+  }
+  return this;
+}
+
+Expr *Array::simplified()
+{
+  for (Expr *&e : *expr_vec)
+  {
+    e = e->simplified();
+  }
+  return this;
+}
+
+Expr *Tuple::simplified()
+{
+  for (Expr *&e : *expr_vec)
+  {
+    e = e->simplified();
+  }
+  return this;
+}
+
+Expr *If::simplified()
+{
+  expr1 = expr1->simplified();
+  expr2 = expr2->simplified();
+  if (expr3 != nullptr)
+  {
+    expr3 = expr3->simplified();
+  }
+  return this;
+}
+
+Expr *While::simplified()
+{
+  cond = cond->simplified();
+  stmt = stmt->simplified();
+  return this;
+}
+
+Expr *For::simplified()
+{
+  start = start->simplified();
+  end = end->simplified();
+  stmt = stmt->simplified();
+  return this;
+}
+
+Expr *Match::simplified()
+{
+  expr = expr->simplified();
+  for (Clause *cl : *clause_vec)
+  {
+    std::vector<NormalDef *> defs;
+    decide_enum d = cl->pat->decide(expr, defs);
+    if (d == decide_unknown)
+    {
+      break;
+    }
+    if (d == decide_fail)
+    {
+      continue;
+    }
+    // Bind the variables in the order the arguments were evaluated
+    Expr *result = cl->expr;
+    for (auto i = defs.rbegin(); i != defs.rend(); i++)
+    {
+      result = new LetIn(new LetDef(false, new std::vector<Def *>{*i}), result);
+      result->typ = typ;
+    }
+    return result->simplified();
+  }
+  for (Clause *cl : *clause_vec)
+  {
+    cl->simplify();
+  }
+  return this;
+}
+
+void Clause::simplify()
+{
+  expr = expr->simplified();
+}
+
+ConstrEntry *id_Expr::get_constr(std::vector<Expr *> &args) const
+{
+  auto known = KnownValues.find(id);
+  return known == KnownValues.end() ? nullptr : known->second->get_constr(args);
+}
+
+ConstrEntry *Id_Expr::get_constr(std::vector<Expr *> &args) const
+{
+  args.clear();
+  return entry;
+}
+
+ConstrEntry *call::get_constr(std::vector<Expr *> &args) const
+{
+  args = *expr_vec;
+  return tt.lookupConstructor(id);
+}
+
+bool Tuple::get_tuple(std::vector<Expr *> &elems) const
+{
+  elems = *expr_vec;
+  return true;
+}
+
+decide_enum Pattern_id::decide(Expr *e, std::vector<NormalDef *> &defs) const
+{
+  if (typ->get_type() == type_func)
+  {
+    return decide_unknown;
+  }
+  defs.push_back(new NormalDef(id, new std::vector<Par *>(), typ, e));
+  return decide_match;
+}
+
+decide_enum Pattern_Id::decide(Expr *e, std::vector<NormalDef *> &defs) const
+{
+  std::vector<Expr *> args;
+  ConstrEntry *c = e->get_constr(args);
+  if (c == nullptr)
+  {
+    return decide_unknown;
+  }
+  return c == entry ? decide_match : decide_fail;
+}
+
+decide_enum Pattern_Call::decide(Expr *e, std::vector<NormalDef *> &defs) const
+{
+  std::vector<Expr *> args;
+  ConstrEntry *c = e->get_constr(args);
+  if (c == nullptr)
+  {
+    return decide_unknown;
+  }
+  if (c != entry)
+  {
+    return decide_fail;
+  }
+  decide_enum result = decide_match;
+  for (size_t i = 0; i < args.size(); i++)
+  {
+    decide_enum d = (*pattern_vec)[i]->decide(args[i], defs);
+    if (d == decide_fail)
+    {
+      return decide_fail;
+    }
+    if (d == decide_unknown)
+    {
+      result = decide_unknown;
+    }
+  }
+  return result;
+}
+
+decide_enum Pattern_Tuple::decide(Expr *e, std::vector<NormalDef *> &defs) const
+{
+  std::vector<Expr *> elems;
+  if (!e->get_tuple(elems))
+  {
+    return decide_unknown;
+  }
+  decide_enum result = decide_match;
+  for (size_t i = 0; i < elems.size(); i++)
+  {
+    decide_enum d = (*pattern_vec)[i]->decide(elems[i], defs);
+    if (d == decide_fail)
+    {
+      return decide_fail;
+    }
+    if (d == decide_unknown)
+    {
+      result = decide_unknown;
+    }
+  }
+  return result;
+}
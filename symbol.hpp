@@ -3,10 +3,17 @@
 #include <cstdlib>
 #include <vector>
 #include <map>
+#include <set>
 #include <unordered_set>
 
 void semerror(std::string msg);
 class Type;
+namespace llvm
+{
+  class StructType;
+  class Function;
+  class Constant;
+}
 
 class SymbolEntry
 {
@@ -86,6 +93,23 @@ private:
   std::vector<Scope> scopes;
 };
 
+class ConstrEntry
+{
+public:
+  std::string Id;
+  std::string type;
+  // Index among the constructors of its type
+  int tag;
+  std::vector<Type *> fields;
+  // Filled in by code generation: the record, holding the tag first unless
+  // pointers to it carry the tag, and the element of it each field is placed at
+  llvm::StructType *structType = nullptr;
+  std::vector<unsigned> slots;
+  llvm::Function *func = nullptr;
+  // Shared instance of a constructor without fields
+  llvm::Constant *value = nullptr;
+};
+
 class TypeDefTable
 {
 public:
@@ -104,7 +128,147 @@ public:
     }
     types.insert(id);
   }
+  ConstrEntry *insertConstructor(std::string &id, std::string &Id, std::vector<Type *> &fields)
+  {
+    ConstrEntry *entry = &constrs[Id];
+    entry->Id = Id;
+    entry->type = id;
+    entry->tag = constructors[id].size();
+    entry->fields = fields;
+    constructors[id].push_back(entry);
+    return entry;
+  }
+  ConstrEntry *lookupConstructor(const std::string &Id)
+  {
+    auto c = constrs.find(Id);
+    return c == constrs.end() ? nullptr : &c->second;
+  }
+  // Constructors of a type, in declaration order
+  std::vector<ConstrEntry *> &getConstructors(const std::string &id)
+  {
+    return constructors[id];
+  }
 
 private:
   std::unordered_set<std::string> types = {};
+  std::map<std::string, ConstrEntry> constrs;
+  std::map<std::string, std::vector<ConstrEntry *>> constructors;
+};
+
+class FunctionEntry
+{
+public:
+  std::set<std::string> uses;
+  std::set<std::string> binds;
+  // Locals of enclosing functions, passed as leading arguments
+  std::vector<std::string> captures;
+  std::vector<std::string> params;
+  // Recursive definition group (0 when not in a let rec)
+  int group;
+};
+
+class FunctionTable
+{
+public:
+  void openFunction(std::string &id)
+  {
+    functions[id] = FunctionEntry();
+    functions[id].group = group;
+    stack.push_back(&functions[id]);
+  }
+  void closeFunction()
+  {
+    FunctionEntry *f = stack.back();
+    stack.pop_back();
+    if (!stack.empty())
+    {
+      stack.back()->uses.insert(f->uses.begin(), f->uses.end());
+      stack.back()->binds.insert(f->binds.begin(), f->binds.end());
+    }
+  }
+  void bind(std::string &id, Type *t)
+  {
+    if (!stack.empty())
+    {
+      stack.back()->binds.insert(id);
+      locals[id] = t;
+    }
+  }
+  void use(std::string &id)
+  {
+    if (!stack.empty())
+    {
+      stack.back()->uses.insert(id);
+    }
+  }
+  FunctionEntry *lookup(const std::string &id)
+  {
+    auto f = functions.find(id);
+    return f == functions.end() ? nullptr : &f->second;
+  }
+  Type *localType(const std::string &id)
+  {
+    return locals[id];
+  }
+  // Whether the binding belongs to some function rather than the top level
+  bool isLocal(const std::string &id) const
+  {
+    return locals.count(id) > 0;
+  }
+  void close()
+  {
+    // Free locals of each function, closed over the functions it uses
+    std::map<std::string, std::set<std::string>> free;
+    for (auto &f : functions)
+    {
+      for (const std::string &u : f.second.uses)
+      {
+        if (locals.count(u) > 0 && f.second.binds.count(u) == 0)
+        {
+          free[f.first].insert(u);
+        }
+      }
+    }
+    bool changed = true;
+    while (changed)
+    {
+      changed = false;
+      for (auto &f : functions)
+      {
+        for (const std::string &u : f.second.uses)
+        {
+          if (functions.count(u) == 0)
+          {
+            continue;
+          }
+          for (const std::string &v : free[u])
+          {
+            if (f.second.binds.count(v) == 0 && free[f.first].insert(v).second)
+            {
+              changed = true;
+            }
+          }
+        }
+      }
+    }
+    for (auto &f : functions)
+    {
+      f.second.captures.assign(free[f.first].begin(), free[f.first].end());
+      used.insert(f.second.uses.begin(), f.second.uses.end());
+    }
+  }
+  // Whether some function refers to the binding
+  bool shared(const std::string &id)
+  {
+    return used.count(id) > 0;
+  }
+
+  int group = 0;
+  int groups = 0;
+
+private:
+  std::map<std::string, FunctionEntry> functions;
+  std::vector<FunctionEntry *> stack;
+  std::map<std::string, Type *> locals;
+  std::set<std::string> used;
 };